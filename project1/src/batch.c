@@ -0,0 +1,251 @@
+/**
+ * @file batch.c
+ * @brief Contains the batch mode processing many TREXIO files with a pool of workers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "headers.h"
+
+/**
+ * @brief Shared state of the worker pool
+ */
+typedef struct {
+    char** files; //! Files to process
+    int n_files; //! Number of files
+    const calc_options* options; //! Calculation options
+    int threads_per_worker; //! Number of OpenMP threads of every worker
+    calc_result* results; //! Results, one per file
+    int next; //! Next file to be processed
+    pthread_mutex_t lock; //! Protects next
+} batch_queue;
+
+/**
+ * @brief Comparison of two strings for qsort
+ * @param a Pointer to the first string
+ * @param b Pointer to the second string
+ * @return Result of strcmp
+ */
+static int compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+/**
+ * @brief Appends a copy of a path to a growing list of files
+ * @param files Pointer to the list of files
+ * @param n_files Pointer to the number of files in the list
+ * @param capacity Pointer to the allocated length of the list
+ * @param path Path to append
+ * @return 0 on success, -1 if memory allocation fails
+ */
+static int append_file(char*** files, int* n_files, int* capacity, const char* path) {
+    if (*n_files == *capacity) {
+        int new_capacity = *capacity > 0 ? 2 * *capacity : 16;
+        char** new_files = realloc(*files, new_capacity * sizeof(char*));
+        if (new_files == NULL) {
+            return -1;
+        }
+        *files = new_files;
+        *capacity = new_capacity;
+    }
+    (*files)[*n_files] = strdup(path);
+    if ((*files)[*n_files] == NULL) {
+        return -1;
+    }
+    (*n_files)++;
+    return 0;
+}
+
+/**
+ * @brief Builds the list of input files
+ *
+ * Files are taken as they are, directories are replaced by the HDF5 files (*.h5)
+ * they contain in alphabetical order.
+ * @param paths Paths given on the command line
+ * @param n_paths Number of paths
+ * @param files Set to the newly allocated list of files
+ * @return Number of files, -1 if a directory cannot be read or memory allocation fails
+ */
+int collect_inputs(char** paths, int n_paths, char*** files) {
+    *files = NULL;
+    int n_files = 0; // Number of files found
+    int capacity = 0; // Allocated length of the list
+
+    for (int p = 0; p < n_paths; p++) {
+        struct stat info;
+        if (stat(paths[p], &info) != 0 || !S_ISDIR(info.st_mode)) {
+            if (append_file(files, &n_files, &capacity, paths[p]) != 0) {
+                free_inputs(*files, n_files);
+                return -1;
+            }
+            continue;
+        }
+
+        DIR* dir = opendir(paths[p]);
+        if (dir == NULL) {
+            fprintf(stderr, "Could not open directory %s\n", paths[p]);
+            free_inputs(*files, n_files);
+            return -1;
+        }
+        int first = n_files; // First file of this directory
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            size_t length = strlen(entry->d_name);
+            if (length < 4 || strcmp(entry->d_name + length - 3, ".h5") != 0) {
+                continue; // Only HDF5 files are processed
+            }
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/%s", paths[p], entry->d_name);
+            if (append_file(files, &n_files, &capacity, path) != 0) {
+                closedir(dir);
+                free_inputs(*files, n_files);
+                return -1;
+            }
+        }
+        closedir(dir);
+        qsort(*files + first, n_files - first, sizeof(char*), compare_names);
+    }
+    return n_files;
+}
+
+/**
+ * @brief Frees a list of input files
+ * @param files List of files
+ * @param n_files Number of files
+ */
+void free_inputs(char** files, int n_files) {
+    for (int f = 0; f < n_files; f++) {
+        free(files[f]);
+    }
+    free(files);
+}
+
+/**
+ * @brief Body of a worker thread
+ *
+ * Takes files from the queue until all are processed, reusing one workspace for
+ * all of its calculations.
+ * @param arg Pointer to the batch_queue
+ * @return NULL
+ */
+static void* batch_worker(void* arg) {
+    batch_queue* queue = arg;
+#ifdef _OPENMP
+    omp_set_num_threads(queue->threads_per_worker); // Every thread has its own setting
+#endif
+    calc_workspace work; // Buffers reused for all files of this worker
+    init_workspace(&work);
+
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        int f = queue->next++; // File to process
+        pthread_mutex_unlock(&queue->lock);
+        if (f >= queue->n_files) {
+            break;
+        }
+        run_calculation(queue->files[f], queue->options, &work, &queue->results[f]);
+    }
+
+    free_workspace(&work);
+    return NULL;
+}
+
+/**
+ * @brief Processes many files with a pool of worker threads
+ * @param files Files to process
+ * @param n_files Number of files
+ * @param options Calculation options
+ * @param n_workers Number of worker threads
+ * @param threads_per_worker Number of OpenMP threads of every worker
+ * @param results Array receiving one result per file
+ */
+void run_batch(char** files, int n_files, const calc_options* options, int n_workers, int threads_per_worker,
+               calc_result* results) {
+    batch_queue queue = {files, n_files, options, threads_per_worker, results, 0, PTHREAD_MUTEX_INITIALIZER};
+    for (int f = 0; f < n_files; f++) {
+        results[f].status = 1; // Files that are never processed count as failed
+    }
+    if (n_workers > n_files) {
+        n_workers = n_files;
+    }
+    if (n_workers < 1) {
+        n_workers = 1;
+    }
+
+    pthread_t* workers = malloc(n_workers * sizeof(pthread_t)); // Worker threads
+    int n_started = 0; // Number of workers that were started
+    if (workers != NULL) {
+        while (n_started < n_workers &&
+               pthread_create(&workers[n_started], NULL, batch_worker, &queue) == 0) {
+            n_started++;
+        }
+    }
+    if (n_started == 0) {
+        batch_worker(&queue); // Process everything in the calling thread
+    }
+    for (int w = 0; w < n_started; w++) {
+        pthread_join(workers[w], NULL);
+    }
+    free(workers);
+    pthread_mutex_destroy(&queue.lock);
+}
+
+/**
+ * @brief Writes the results of a batch as a CSV table
+ * @param out Output stream
+ * @param files Processed files
+ * @param results Results, one per file
+ * @param n_files Number of files
+ */
+void write_results_csv(FILE* out, char** files, const calc_result* results, int n_files) {
+    fprintf(out, "file,status,n_up,mo_num,n_integrals,nuc_repul,one_el_energy,two_el_energy,"
+                 "HF_energy,MP2_energy,total_energy,time_setup,time_hf,time_mp2,time_total\n");
+    for (int f = 0; f < n_files; f++) {
+        const calc_result* r = &results[f];
+        if (r->status != 0) {
+            fprintf(out, "%s,error,,,,,,,,,,,,,\n", files[f]);
+            continue;
+        }
+        fprintf(out, "%s,ok,%d,%d,%ld,%.10f,%.10f,%.10f,%.10f,%.10f,%.10f,%.6f,%.6f,%.6f,%.6f\n",
+                files[f], r->n_up, r->mo_num, r->n_integrals, r->nuc_repul, r->one_el_energy,
+                r->two_el_energy, r->HF_energy, r->MP2_energy, r->HF_energy + r->MP2_energy,
+                r->time_setup, r->time_hf, r->time_mp2, r->time_total);
+    }
+}
+
+/**
+ * @brief Writes the results of a batch as a JSON array
+ * @param out Output stream
+ * @param files Processed files
+ * @param results Results, one per file
+ * @param n_files Number of files
+ */
+void write_results_json(FILE* out, char** files, const calc_result* results, int n_files) {
+    fprintf(out, "[\n");
+    for (int f = 0; f < n_files; f++) {
+        const calc_result* r = &results[f];
+        fprintf(out, "  {\"file\": ");
+        write_json_string(out, files[f]);
+        if (r->status != 0) {
+            fprintf(out, ", \"status\": \"error\"}");
+        }
+        else {
+            fprintf(out, ", \"status\": \"ok\", \"n_up\": %d, \"mo_num\": %d, \"n_integrals\": %ld, "
+                         "\"nuc_repul\": %.10f, \"one_el_energy\": %.10f, \"two_el_energy\": %.10f, "
+                         "\"HF_energy\": %.10f, \"MP2_energy\": %.10f, \"total_energy\": %.10f, "
+                         "\"time_setup\": %.6f, \"time_hf\": %.6f, \"time_mp2\": %.6f, \"time_total\": %.6f}",
+                    r->n_up, r->mo_num, r->n_integrals, r->nuc_repul, r->one_el_energy, r->two_el_energy,
+                    r->HF_energy, r->MP2_energy, r->HF_energy + r->MP2_energy,
+                    r->time_setup, r->time_hf, r->time_mp2, r->time_total);
+        }
+        fprintf(out, "%s\n", f + 1 < n_files ? "," : "");
+    }
+    fprintf(out, "]\n");
+}
@@ -0,0 +1,430 @@
+/**
+ * @file bench.c
+ * @brief Contains the benchmark and regression harness of the HF and MP2 kernels.
+ *
+ * Every input is first calculated with run_calculation and its energies are compared
+ * with the reference output in tests/. The kernels are then timed on the integrals of
+ * the input and on synthetic integral sets of larger basis sets. The throughput can be
+ * stored as a baseline and later runs fail if they are slower than the baseline.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "headers.h"
+
+#define N_KERNELS 4 // Number of benchmarked kernels
+#define MIN_SAMPLE_TIME 0.02 // Minimal wall-clock time of one sample in seconds
+#define ENERGY_TOLERANCE 1e-6 // Allowed deviation from the reference energies, which have six decimals
+#define MAX_RESULTS 256 // Maximal number of benchmark results
+
+static const char* kernel_names[N_KERNELS] = {
+    "one_electron", "two_electron", "mp2_store", "lookup"
+}; //! Names of the benchmarked kernels
+
+/**
+ * @brief Integrals and orbital energies of one benchmark input
+ */
+typedef struct {
+    char name[256]; //! Name of the input
+    int32_t n_up; //! Number of occupied orbitals
+    int32_t mo_num; //! Number of molecular orbitals
+    int64_t n_integrals; //! Number of two-electron integrals
+    const packed_index* index; //! Packed indices of the two-electron integrals
+    const double* value; //! Values of the two-electron integrals
+    double* data; //! One-electron integrals
+    double* mo_energy; //! Molecular orbital energies
+    integral_store store; //! Store holding all two-electron integrals
+} bench_input;
+
+/**
+ * @brief Throughput of one kernel on one input
+ */
+typedef struct {
+    char name[300]; //! Kernel and input, e.g. mp2_store/h2o
+    double median; //! Median throughput in integrals per second
+    double min; //! Lowest throughput of all samples
+    double max; //! Highest throughput of all samples
+} bench_result;
+
+static volatile double sink; //! Keeps the compiler from dropping the benchmarked calls
+
+/**
+ * @brief Runs a kernel once on an input
+ * @param kernel Kernel number
+ * @param input Input of the kernel
+ * @return Number of integrals processed
+ */
+static int64_t run_kernel(int kernel, bench_input* input) {
+    switch (kernel) {
+    case 0:
+        sink = one_electron_energy(input->data, input->n_up, input->mo_num);
+        return input->n_up;
+    case 1:
+        sink = two_electron_energy(input->index, input->value, input->n_up, input->n_integrals);
+        return input->n_integrals;
+    case 2: {
+        sink = MP2_energy_correction(&input->store, input->mo_energy, input->n_up, input->mo_num);
+        int64_t n_virt = input->mo_num - input->n_up;
+        return 2 * (int64_t) input->n_up * input->n_up * n_virt * n_virt; // Two lookups per term
+    }
+    default: {
+        // Every integral is looked up with permuted indices
+        double sum = 0;
+        const packed_index* index = input->index;
+        for (int64_t n = 0; n < input->n_integrals; n++) {
+            sum += get_integral(&input->store, UNPACK_INDEX(index[n], 1), UNPACK_INDEX(index[n], 0),
+                                UNPACK_INDEX(index[n], 3), UNPACK_INDEX(index[n], 2));
+        }
+        sink = sum;
+        return input->n_integrals;
+    }
+    }
+}
+
+/**
+ * @brief Comparison of two doubles for qsort
+ * @param a Pointer to the first double
+ * @param b Pointer to the second double
+ * @return -1, 0 or 1
+ */
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Measures the throughput of a kernel on an input
+ *
+ * The number of calls per sample is doubled until a sample takes at least
+ * MIN_SAMPLE_TIME, so short kernels are not dominated by the timer resolution.
+ * @param kernel Kernel number
+ * @param input Input of the kernel
+ * @param n_samples Number of samples
+ * @param result Result receiving the throughput statistics
+ */
+static void measure_kernel(int kernel, bench_input* input, int n_samples, bench_result* result) {
+    int64_t calls = 1; // Number of calls per sample
+    for (;;) {
+        double start = wall_time();
+        for (int64_t c = 0; c < calls; c++) {
+            run_kernel(kernel, input);
+        }
+        if (wall_time() - start >= MIN_SAMPLE_TIME || calls >= (1 << 30)) {
+            break;
+        }
+        calls *= 2;
+    }
+
+    double* throughput = malloc(n_samples * sizeof(double)); // Throughput of every sample
+    if (throughput == NULL) {
+        fprintf(stderr, "Memory allocation failed for the samples!\n");
+        exit(1);
+    }
+    for (int s = 0; s < n_samples; s++) {
+        int64_t items = 0;
+        double start = wall_time();
+        for (int64_t c = 0; c < calls; c++) {
+            items += run_kernel(kernel, input);
+        }
+        double time = wall_time() - start;
+        throughput[s] = time > 0 ? items / time : 0;
+    }
+    qsort(throughput, n_samples, sizeof(double), compare_doubles);
+
+    snprintf(result->name, sizeof(result->name), "%s/%s", kernel_names[kernel], input->name);
+    result->median = n_samples % 2 ? throughput[n_samples / 2]
+                                   : 0.5 * (throughput[n_samples / 2 - 1] + throughput[n_samples / 2]);
+    result->min = throughput[0];
+    result->max = throughput[n_samples - 1];
+    free(throughput);
+}
+
+/**
+ * @brief Reads a value following a label in a reference output
+ * @param filename Reference output
+ * @param label Label of the value, e.g. "Hartree-Fock energy:"
+ * @param value Set to the value
+ * @return 0 on success, -1 if the file or the label is missing
+ */
+static int read_reference(const char* filename, const char* label, double* value) {
+    FILE* file = fopen(filename, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    char line[1024];
+    int status = -1;
+    size_t length = strlen(label);
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, label, length) == 0 && sscanf(line + length, "%lf", value) == 1) {
+            status = 0;
+            break;
+        }
+    }
+    fclose(file);
+    return status;
+}
+
+/**
+ * @brief Compares the energies of a calculation with the reference output
+ * @param name Name of the molecule, the reference is tests/<name>.out
+ * @param result Result of the calculation
+ * @return 0 if the energies agree or no reference exists, 1 otherwise
+ */
+static int check_energies(const char* name, const calc_result* result) {
+    char filename[512];
+    snprintf(filename, sizeof(filename), "tests/%s.out", name);
+    double hf_reference, mp2_reference;
+    if (read_reference(filename, "Hartree-Fock energy:", &hf_reference) != 0 ||
+        read_reference(filename, "MP2 energy correction:", &mp2_reference) != 0) {
+        printf("%-10s no reference energies in %s\n", name, filename);
+        return 0;
+    }
+    double hf_error = fabs(result->HF_energy - hf_reference);
+    double mp2_error = fabs(result->MP2_energy - mp2_reference);
+    int failed = hf_error > ENERGY_TOLERANCE || mp2_error > ENERGY_TOLERANCE;
+    printf("%-10s HF %12.6f (ref %12.6f)  MP2 %10.6f (ref %10.6f)  %s\n", name, result->HF_energy,
+           hf_reference, result->MP2_energy, mp2_reference, failed ? "FAILED" : "ok");
+    return failed;
+}
+
+/**
+ * @brief Generates a synthetic set of two-electron integrals
+ *
+ * Every symmetry-unique integral is present once, with values decaying with the
+ * distance of the orbital indices, so the integral store is filled as for a real
+ * molecule. The values are reproducible.
+ * @param input Input receiving the integrals, n_up and mo_num must be set
+ * @param index Set to the newly allocated indices
+ * @param value Set to the newly allocated values
+ * @return 0 on success, -1 if memory allocation fails
+ */
+static int generate_integrals(bench_input* input, packed_index** index, double** value) {
+    int64_t mo_num = input->mo_num;
+    int64_t n_pairs = mo_num * (mo_num + 1) / 2;
+    int64_t n_integrals = n_pairs * (n_pairs + 1) / 2;
+    *index = malloc(n_integrals * sizeof(packed_index));
+    *value = malloc(n_integrals * sizeof(double));
+    input->data = calloc(mo_num * mo_num, sizeof(double));
+    input->mo_energy = malloc(mo_num * sizeof(double));
+    if (*index == NULL || *value == NULL || input->data == NULL || input->mo_energy == NULL) {
+        return -1;
+    }
+
+    uint64_t state = 88172645463325252ULL; // xorshift64 state
+    int64_t n = 0;
+    for (int i = 0; i < mo_num; i++) {
+        for (int k = 0; k <= i; k++) {
+            for (int j = 0; j <= i; j++) {
+                for (int l = 0; l <= (j == i ? k : j); l++) {
+                    state ^= state << 13;
+                    state ^= state >> 7;
+                    state ^= state << 17;
+                    double random = (state >> 11) * 0x1.0p-53; // Uniform in [0, 1)
+                    (*index)[n] = PACK_INDEX(i, j, k, l);
+                    (*value)[n++] = (0.5 + random) / (1 + abs(i - k) + abs(j - l));
+                }
+            }
+        }
+    }
+    for (int p = 0; p < mo_num; p++) {
+        input->data[p * mo_num + p] = -2.0 + 0.01 * p;
+        input->mo_energy[p] = p < input->n_up ? -1.0 + 0.02 * p : 0.2 + 0.05 * (p - input->n_up);
+    }
+    input->n_integrals = n;
+    input->index = *index;
+    input->value = *value;
+    return 0;
+}
+
+/**
+ * @brief Benchmarks all kernels on an input
+ * @param input Input with the integrals, the store is built here
+ * @param n_samples Number of samples per kernel
+ * @param results Array receiving the results
+ * @param n_results Pointer to the number of results
+ */
+static void bench_input_kernels(bench_input* input, int n_samples, bench_result* results, int* n_results) {
+    if (build_integral_store(&input->store, input->index, input->value, input->n_integrals) != 0) {
+        fprintf(stderr, "Allocation of the integral store failed\n");
+        exit(1);
+    }
+    for (int kernel = 0; kernel < N_KERNELS && *n_results < MAX_RESULTS; kernel++) {
+        bench_result* result = &results[(*n_results)++];
+        measure_kernel(kernel, input, n_samples, result);
+        printf("%-28s %14.4e %14.4e %14.4e\n", result->name, result->median, result->min, result->max);
+    }
+    free_integral_store(&input->store);
+}
+
+/**
+ * @brief Compares the throughput with a baseline
+ *
+ * The medians are compared, so single slow or fast samples do not trigger a
+ * regression. Kernels missing from the baseline are skipped.
+ * @param filename Baseline file, one line "name throughput" per result
+ * @param results Results of this run
+ * @param n_results Number of results
+ * @param threshold Allowed relative slowdown, e.g. 0.2 for 20 %
+ * @return Number of regressions, -1 if the baseline cannot be read
+ */
+static int compare_baseline(const char* filename, const bench_result* results, int n_results, double threshold) {
+    FILE* file = fopen(filename, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    int n_regressions = 0;
+    char name[300];
+    double baseline;
+    while (fscanf(file, "%299s %lf", name, &baseline) == 2) {
+        for (int r = 0; r < n_results; r++) {
+            if (strcmp(results[r].name, name) != 0) {
+                continue;
+            }
+            double ratio = results[r].median / baseline;
+            if (ratio < 1 - threshold) {
+                printf("%-28s %6.1f %% slower than the baseline, REGRESSION\n", name, 100 * (1 - ratio));
+                n_regressions++;
+            }
+        }
+    }
+    fclose(file);
+    return n_regressions;
+}
+
+/**
+ * @brief The main entry point of the benchmark.
+ *
+ * Usage: bench_HF_and_MP2 [-s samples] [-j threads] [-m mo_num]... [-B baseline]
+ * [-u baseline] [-T threshold] files...
+ *
+ * @return int Returns 0 if all energies agree and no kernel regressed.
+ */
+int main(int argc, char *argv[]) {
+    int n_samples = 7; //! Number of samples per kernel
+    int32_t synthetic[16]; //! Basis set sizes of the synthetic inputs
+    int n_synthetic = 0; //! Number of synthetic inputs
+    const char* baseline_name = NULL; //! Baseline to compare with
+    const char* update_name = NULL; //! Baseline to write
+    double threshold = 0.2; //! Allowed relative slowdown
+    char** files = malloc((argc > 1 ? argc : 1) * sizeof(char*)); //! Input files
+    int n_files = 0; //! Number of input files
+    if (files == NULL) {
+        fprintf(stderr, "Memory allocation failed!\n");
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        int has_value = i + 1 < argc;
+        if (strcmp(argv[i], "-s") == 0 && has_value && atoi(argv[i + 1]) > 0) {
+            n_samples = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-j") == 0 && has_value && atoi(argv[i + 1]) > 0) {
+#ifdef _OPENMP
+            omp_set_num_threads(atoi(argv[i + 1]));
+#endif
+            i++;
+        }
+        else if (strcmp(argv[i], "-m") == 0 && has_value && atoi(argv[i + 1]) > 1 && n_synthetic < 16) {
+            synthetic[n_synthetic++] = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-B") == 0 && has_value) {
+            baseline_name = argv[++i];
+        }
+        else if (strcmp(argv[i], "-u") == 0 && has_value) {
+            update_name = argv[++i];
+        }
+        else if (strcmp(argv[i], "-T") == 0 && has_value && atof(argv[i + 1]) > 0) {
+            threshold = atof(argv[++i]);
+        }
+        else if (argv[i][0] == '-') {
+            fprintf(stderr, "Unknown or incomplete option %s\n", argv[i]);
+            free(files);
+            return 1;
+        }
+        else {
+            files[n_files++] = argv[i];
+        }
+    }
+
+    bench_result results[MAX_RESULTS]; //! Throughput of every kernel and input
+    int n_results = 0; //! Number of results
+    int n_failed = 0; //! Number of inputs with wrong energies or failed calculations
+
+    printf("%-28s %14s %14s %14s\n", "Kernel/input", "Median (1/s)", "Min (1/s)", "Max (1/s)");
+    calc_options options = {0, 0, 0, 0}; // Integral store path, all integrals in memory
+    calc_workspace work; //! Buffers of the calculations, holding the integrals of the last file
+    calc_result calc; //! Result of the last calculation
+    init_workspace(&work);
+    for (int f = 0; f < n_files; f++) {
+        bench_input input; //! Integrals of the file, taken from the workspace
+        memset(&input, 0, sizeof(input));
+        const char* base = strrchr(files[f], '/') != NULL ? strrchr(files[f], '/') + 1 : files[f];
+        snprintf(input.name, sizeof(input.name), "%.*s", (int) strcspn(base, "."), base);
+        if (run_calculation(files[f], &options, &work, &calc) != 0) {
+            printf("%-10s FAILED\n", input.name);
+            n_failed++;
+            continue;
+        }
+        n_failed += check_energies(input.name, &calc);
+
+        input.n_up = calc.n_up;
+        input.mo_num = calc.mo_num;
+        input.n_integrals = calc.n_integrals;
+        input.index = (const packed_index*) work.index; // Packed by run_calculation
+        input.value = work.value;
+        input.data = work.data;
+        input.mo_energy = work.mo_energy;
+        bench_input_kernels(&input, n_samples, results, &n_results);
+    }
+    free_workspace(&work);
+
+    for (int s = 0; s < n_synthetic; s++) {
+        bench_input input;
+        memset(&input, 0, sizeof(input));
+        input.mo_num = synthetic[s];
+        input.n_up = synthetic[s] / 6 > 0 ? synthetic[s] / 6 : 1;
+        snprintf(input.name, sizeof(input.name), "synthetic%d", synthetic[s]);
+        packed_index* index = NULL;
+        double* value = NULL;
+        if (generate_integrals(&input, &index, &value) != 0) {
+            fprintf(stderr, "Memory allocation failed for the synthetic integrals!\n");
+            exit(1);
+        }
+        bench_input_kernels(&input, n_samples, results, &n_results);
+        free(index);
+        free(value);
+        free(input.data);
+        free(input.mo_energy);
+    }
+    free(files);
+
+    int n_regressions = 0; //! Number of kernels slower than the baseline
+    if (baseline_name != NULL) {
+        n_regressions = compare_baseline(baseline_name, results, n_results, threshold);
+        if (n_regressions < 0) {
+            printf("\nNo baseline found in %s, run make bench-baseline to record one\n", baseline_name);
+            n_regressions = 0;
+        }
+    }
+    if (update_name != NULL) {
+        FILE* file = fopen(update_name, "w");
+        if (file == NULL) {
+            fprintf(stderr, "Could not open file %s for writing.\n", update_name);
+            return 1;
+        }
+        for (int r = 0; r < n_results; r++) {
+            fprintf(file, "%s %.6e\n", results[r].name, results[r].median);
+        }
+        fclose(file);
+        printf("\nBaseline written to %s\n", update_name);
+    }
+
+    printf("\n%d energy failures, %d performance regressions\n", n_failed, n_regressions);
+    return (n_failed > 0 || n_regressions > 0) ? 1 : 0;
+}
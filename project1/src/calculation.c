@@ -0,0 +1,410 @@
+/**
+ * @file calculation.c
+ * @brief Contains the HF and MP2 calculation for a single TREXIO file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <trexio.h>
+#include "headers.h"
+
+/**
+ * @brief Makes sure a reusable buffer can hold a given number of bytes
+ * @param buffer Pointer to the buffer, reallocated if it is too small
+ * @param capacity Pointer to the current size of the buffer in bytes
+ * @param size Required size in bytes
+ * @return 0 on success, -1 if memory allocation fails
+ */
+static int reserve_buffer(void** buffer, size_t* capacity, size_t size) {
+    if (*capacity >= size && *buffer != NULL) {
+        return 0;
+    }
+    free(*buffer);
+    *buffer = malloc(size > 0 ? size : 1);
+    *capacity = (*buffer != NULL) ? size : 0;
+    return (*buffer != NULL) ? 0 : -1;
+}
+
+/**
+ * @brief Initializes an empty workspace
+ * @param work Workspace to initialize
+ */
+void init_workspace(calc_workspace* work) {
+    memset(work, 0, sizeof(*work));
+}
+
+/**
+ * @brief Frees all buffers held by a workspace
+ * @param work Workspace to free
+ */
+void free_workspace(calc_workspace* work) {
+    free(work->mo_energy);
+    free(work->data);
+    free(work->index);
+    free(work->value);
+    free(work->ovov_block);
+    free_integral_buckets(&work->buckets);
+    free_integral_store(&work->store);
+    free_eri_reader(&work->reader);
+    close_phase_timer(&work->timer);
+    init_workspace(work);
+}
+
+/**
+ * @brief Reads the scalar data, the orbital energies and the one-electron integrals
+ *
+ * Must be called with trexio_lock held.
+ * @param trexio_file TREXIO file handle
+ * @param work Workspace receiving the orbital energies and one-electron integrals, holds the phase timer
+ * @param result Result receiving the system information and the phase statistics
+ * @return 0 on success, 1 otherwise
+ */
+static int read_header(trexio_t* trexio_file, calc_workspace* work, calc_result* result) {
+    trexio_exit_code rc; //! TREXIO output
+    phase_stats* phases = &result->phases;
+    phase_begin(&work->timer);
+
+    // Read the nuclear repulsion energy
+    rc = trexio_read_nucleus_repulsion(trexio_file, &result->nuc_repul);
+    if (rc != TREXIO_SUCCESS) {
+        fprintf(stderr, "TREXIO Error reading nuclear repulsion energy:\n%s\n",
+                trexio_string_of_error(rc));
+        return 1;
+    }
+
+    // Obtain the number of occupied orbitals
+    rc = trexio_read_electron_up_num(trexio_file, &result->n_up);
+    if (rc != TREXIO_SUCCESS) {
+        fprintf(stderr, "TREXIO Error reading number of spin-up electrons:\n%s\n",
+                trexio_string_of_error(rc));
+        return 1;
+    }
+
+    // Obtain the number of molecular orbitals
+    rc = trexio_read_mo_num(trexio_file, &result->mo_num);
+    if (rc != TREXIO_SUCCESS) {
+        fprintf(stderr, "TREXIO Error reading number of molecular orbitals:\n%s\n",
+                trexio_string_of_error(rc));
+        return 1;
+    }
+    if (result->mo_num > MAX_PACKED_MO_NUM) {
+        fprintf(stderr, "At most %d molecular orbitals are supported, found %d\n", MAX_PACKED_MO_NUM, result->mo_num);
+        return 1;
+    }
+    int64_t mo_num = result->mo_num;
+
+    // Read in the orbital energies
+    if (reserve_buffer((void**) &work->mo_energy, &work->mo_energy_size, mo_num * sizeof(double)) != 0) {
+        fprintf(stderr, "Failed to allocate memory for orbital energies\n");
+        return 1;
+    }
+    rc = trexio_read_mo_energy(trexio_file, work->mo_energy);
+    if (rc != TREXIO_SUCCESS) {
+        fprintf(stderr, "Error reading orbital energies: %s\n",
+                trexio_string_of_error(rc));
+        return 1;
+    }
+    phase_end(&work->timer, phases, PHASE_METADATA);
+    phases->bytes[PHASE_METADATA] += sizeof(double) + 2 * sizeof(int32_t) + mo_num * sizeof(double);
+    phase_begin(&work->timer);
+
+    // Read in the one-electron integrals
+    if (reserve_buffer((void**) &work->data, &work->data_size, mo_num * mo_num * sizeof(double)) != 0) {
+        fprintf(stderr, "Allocation of data array for one-electron integrals failed\n");
+        return 1;
+    }
+    rc = trexio_read_mo_1e_int_core_hamiltonian(trexio_file, work->data);
+    if (rc != TREXIO_SUCCESS) {
+        fprintf(stderr, "TREXIO Error reading one-electron integrals:\n%s\n",
+                trexio_string_of_error(rc));
+        return 1;
+    }
+    phase_end(&work->timer, phases, PHASE_ONE_E_READ);
+    phases->bytes[PHASE_ONE_E_READ] += mo_num * mo_num * sizeof(double);
+    phase_begin(&work->timer);
+
+    // Get number of non-zero two-electron integrals
+    rc = trexio_read_mo_2e_int_eri_size(trexio_file, &result->n_integrals);
+    if (rc != TREXIO_SUCCESS) {
+        fprintf(stderr, "TREXIO Error reading number of non-zero two-electron integrals:\n%s\n",
+                trexio_string_of_error(rc));
+        return 1;
+    }
+    phase_end(&work->timer, phases, PHASE_METADATA);
+    phases->bytes[PHASE_METADATA] += sizeof(int64_t);
+    return 0;
+}
+
+/**
+ * @brief Reads all two-electron integrals at once and packs their indices
+ *
+ * Must be called with trexio_lock held.
+ * @param trexio_file TREXIO file handle
+ * @param work Workspace receiving the integrals
+ * @param result Result holding the system information
+ * @return 0 on success, 1 otherwise
+ */
+static int read_all_integrals(trexio_t* trexio_file, calc_workspace* work, calc_result* result) {
+    int64_t n_integrals = result->n_integrals;
+
+    // Allocate memory for storing the indices and the values of the integrals
+    if (reserve_buffer((void**) &work->index, &work->index_size, 4 * n_integrals * sizeof(int32_t)) != 0 ||
+        reserve_buffer((void**) &work->value, &work->value_size, n_integrals * sizeof(double)) != 0) {
+        fprintf(stderr, "Allocation of arrays for two-electron integrals failed\n");
+        return 1;
+    }
+
+    // Read in the integrals
+    int64_t buffer_size = n_integrals; //! Buffer size for reading, initially equal to number of two-electron integrals
+    trexio_exit_code rc = trexio_read_mo_2e_int_eri(trexio_file, 0, &buffer_size, work->index, work->value);
+    if (rc != TREXIO_SUCCESS) {
+        fprintf(stderr, "TREXIO Error reading two-electron integrals:\n%s\n",
+                trexio_string_of_error(rc));
+        return 1;
+    }
+
+    // Check if buffer size is equal to number of integrals
+    if (buffer_size != n_integrals) {
+        fprintf(stderr, "Not all two-electron integrals were read correctly\n");
+        return 1;
+    }
+    result->phases.bytes[PHASE_ERI_READ] += n_integrals * (4 * sizeof(int32_t) + sizeof(double));
+
+    // Pack the indices in place, halving the memory traffic of the kernels
+    pack_indices(work->index, n_integrals);
+    return 0;
+}
+
+/**
+ * @brief Sorts the two-electron integrals by class and prepares the MP2 intermediates
+ *
+ * The (ov|ov) integrals are either extracted into the dense (ia|jb) block or indexed
+ * in the integral store.
+ * @param dense_mp2 Defines whether the (ia|jb) block should be extracted
+ * @param work Workspace holding the integrals read by read_all_integrals
+ * @param result Result holding the system information
+ * @return 0 on success, 1 otherwise
+ */
+static int prepare_integrals(int dense_mp2, calc_workspace* work, calc_result* result) {
+    int64_t n_integrals = result->n_integrals;
+
+    // Sort the integrals by occupancy class, HF and MP2 each need only one class
+    integral_buckets* buckets = &work->buckets;
+    const packed_index* index = (const packed_index*) work->index; // Packed by read_all_integrals
+    if (sort_integrals_by_class(index, work->value, n_integrals, result->n_up, buckets) != 0) {
+        fprintf(stderr, "Allocation of the sorted two-electron integrals failed\n");
+        return 1;
+    }
+    int64_t ovov_start = buckets->start[CLASS_OVOV]; //! First (ov|ov) integral
+    int64_t n_ovov = buckets->start[CLASS_OVOV + 1] - ovov_start; //! Number of (ov|ov) integrals
+
+    if (dense_mp2) {
+        // Extract the dense occupied-virtual block for the dense MP2 kernel
+        extract_ovov_block(buckets->index + ovov_start, buckets->value + ovov_start, n_ovov,
+                           result->n_up, result->mo_num, work->ovov_block);
+        return 0;
+    }
+
+    // Index the (ov|ov) integrals by their canonical key for constant-time lookups
+    if (build_integral_store(&work->store, buckets->index + ovov_start, buckets->value + ovov_start, n_ovov) != 0) {
+        fprintf(stderr, "Allocation of the two-electron integral store failed\n");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Streams the two-electron integrals in chunks through a reader thread
+ *
+ * The HF two-electron energy and the (ia|jb) block are accumulated chunk by chunk,
+ * the processing of the chunks is added to the HF and MP2 phases.
+ * @param trexio_file TREXIO file handle
+ * @param chunk_size Maximum number of integrals per chunk
+ * @param work Workspace holding the reader and the (ia|jb) block
+ * @param result Result receiving the two-electron energy and the phase statistics
+ * @return 0 on success, 1 otherwise
+ */
+static int stream_integrals(trexio_t* trexio_file, int64_t chunk_size, calc_workspace* work, calc_result* result) {
+    if (chunk_size > result->n_integrals) {
+        chunk_size = result->n_integrals > 0 ? result->n_integrals : 1;
+    }
+    result->chunk_size = chunk_size;
+
+    // A reader thread fills one buffer while the previous chunk is processed
+    eri_reader* reader = &work->reader;
+    if (eri_reader_start(reader, trexio_file, result->n_integrals, chunk_size) != 0) {
+        fprintf(stderr, "Starting the reader thread for the two-electron integrals failed\n");
+        return 1;
+    }
+
+    const packed_index* index; //! Packed indices of the current chunk of integrals
+    const double* value; //! Values of the current chunk of integrals
+    int64_t buffer_size; //! Number of integrals in the current chunk
+    while ((buffer_size = eri_reader_next(reader, &index, &value)) > 0) {
+        phase_begin(&work->timer);
+        result->two_el_energy += two_electron_energy(index, value, result->n_up, buffer_size);
+        phase_end(&work->timer, &result->phases, PHASE_HF);
+        phase_begin(&work->timer);
+        extract_ovov_block(index, value, buffer_size, result->n_up, result->mo_num, work->ovov_block);
+        phase_end(&work->timer, &result->phases, PHASE_MP2);
+        result->phases.bytes[PHASE_ERI_READ] += buffer_size * (4 * sizeof(int32_t) + sizeof(double));
+    }
+
+    // The reads run in the reader thread, so only their wall-clock time is known
+    trexio_exit_code rc = eri_reader_finish(reader);
+    result->io_read_time = reader->read_time;
+    result->io_wait_time = reader->wait_time;
+    result->phases.time[PHASE_ERI_READ] += reader->read_time;
+    if (rc != TREXIO_SUCCESS) {
+        fprintf(stderr, "TREXIO Error reading two-electron integrals at offset %ld:\n%s\n",
+                reader->error_offset, trexio_string_of_error(rc));
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Calculates the HF energy and the MP2 correction for one TREXIO file
+ *
+ * All buffers are taken from the workspace, so they are reused when several files
+ * are processed with the same workspace. TREXIO calls are serialized through
+ * trexio_lock, so several calculations may run concurrently.
+ * @param filename Path to the TREXIO file
+ * @param options Calculation options
+ * @param work Workspace providing reusable buffers
+ * @param result Energies, system information and timings of the calculation
+ * @return 0 on success, 1 otherwise
+ */
+int run_calculation(const char* filename, const calc_options* options, calc_workspace* work, calc_result* result) {
+    double start_total = wall_time(); // Wall-clock time stays meaningful with several threads
+    memset(result, 0, sizeof(*result));
+    result->status = 1;
+
+    // The timer is set up by the first calculation of a workspace
+    phase_timer* timer = &work->timer; //! Timer of the calculation phases
+    phase_stats* phases = &result->phases; //! Statistics of the calculation phases
+    if (!timer->initialized && init_phase_timer(timer, options->hw_counters) != 0) {
+        fprintf(stderr, "Hardware counters are not available, only wall-clock times are recorded\n");
+    }
+    result->hw_counters = timer->counters;
+
+    // The dense MP2 kernel is always used when the integrals are streamed
+    int dense_mp2 = options->dense_mp2 || options->chunk_size > 0;
+    result->dense_mp2 = dense_mp2;
+
+    // Open the TREXIO file and read everything but the two-electron integrals
+    trexio_exit_code rc; //! TREXIO output
+    pthread_mutex_lock(&trexio_lock);
+    phase_begin(timer);
+    trexio_t* trexio_file = trexio_open(filename, 'r', TREXIO_AUTO, &rc); //! TREXIO file handler
+    phase_end(timer, phases, PHASE_OPEN);
+    if (rc != TREXIO_SUCCESS) {
+        pthread_mutex_unlock(&trexio_lock);
+        fprintf(stderr, "TREXIO Error opening %s: %s\n", filename, trexio_string_of_error(rc));
+        return 1;
+    }
+    int status = read_header(trexio_file, work, result);
+    pthread_mutex_unlock(&trexio_lock);
+
+    // Allocate the dense occupied-virtual block for the dense MP2 kernel
+    int64_t n_up = result->n_up;
+    int64_t n_virt = result->mo_num - result->n_up; //! Number of virtual orbitals
+    if (status == 0 && dense_mp2) {
+        phase_begin(timer);
+        size_t block_size = n_up * n_virt * n_up * n_virt * sizeof(double);
+        if (reserve_buffer((void**) &work->ovov_block, &work->ovov_block_size, block_size) != 0) {
+            fprintf(stderr, "Allocation of the dense (ia|jb) block failed\n");
+            status = 1;
+        }
+        else {
+            memset(work->ovov_block, 0, block_size);
+        }
+        phase_end(timer, phases, PHASE_PREPARE);
+    }
+
+    // Read the two-electron integrals
+    if (status == 0) {
+        if (options->chunk_size > 0) {
+            status = stream_integrals(trexio_file, options->chunk_size, work, result);
+        }
+        else {
+            pthread_mutex_lock(&trexio_lock);
+            phase_begin(timer);
+            status = read_all_integrals(trexio_file, work, result);
+            phase_end(timer, phases, PHASE_ERI_READ);
+            pthread_mutex_unlock(&trexio_lock);
+        }
+    }
+
+    // Close the TREXIO file
+    pthread_mutex_lock(&trexio_lock);
+    phase_begin(timer);
+    rc = trexio_close(trexio_file);
+    phase_end(timer, phases, PHASE_CLOSE);
+    pthread_mutex_unlock(&trexio_lock);
+    if (rc != TREXIO_SUCCESS) {
+        fprintf(stderr, "TREXIO Error: %s\n", trexio_string_of_error(rc));
+        status = 1;
+    }
+    if (status == 0 && options->chunk_size == 0) {
+        phase_begin(timer);
+        status = prepare_integrals(dense_mp2, work, result);
+        phase_end(timer, phases, PHASE_PREPARE);
+    }
+    if (status != 0) {
+        fprintf(stderr, "Calculation for %s failed\n", filename);
+        return status;
+    }
+
+    if (options->verbose) {
+        printf("\nCalculating the Hartree-Fock energy...\n");
+    }
+
+    phase_begin(timer); // Start timing the Hartree-Fock energy calculation
+
+    // Calculate one-electron energy contribution
+    result->one_el_energy = one_electron_energy(work->data, result->n_up, result->mo_num);
+
+    // Calculate the two-electron energy contribution, unless it was accumulated while streaming
+    if (options->chunk_size == 0) {
+        integral_buckets* buckets = &work->buckets;
+        int64_t oooo_start = buckets->start[CLASS_OOOO]; // Only the oooo class contributes
+        result->two_el_energy = two_electron_energy(buckets->index + oooo_start, buckets->value + oooo_start,
+                                                    result->n_up, buckets->start[CLASS_OOOO + 1] - oooo_start);
+    }
+
+    // Calculate the Hartree-Fock energy
+    result->HF_energy = hartree_fock_energy(result->nuc_repul, result->one_el_energy, result->two_el_energy);
+
+    phase_end(timer, phases, PHASE_HF); // End timing the Hartree-Fock energy calculation
+
+    if (options->verbose) {
+        printf("Done!\n");
+        printf("\nCalculating the MP2 energy correction...\n");
+    }
+
+    phase_begin(timer); // Start timing the MP2 energy correction calculation
+
+    // Calculate MP2 energy
+    if (dense_mp2) {
+        result->MP2_energy = MP2_energy_dense(work->ovov_block, work->mo_energy, result->n_up, result->mo_num);
+    }
+    else {
+        result->MP2_energy = MP2_energy_correction(&work->store, work->mo_energy, result->n_up, result->mo_num);
+    }
+
+    phase_end(timer, phases, PHASE_MP2); // End timing the MP2 energy correction calculation
+
+    if (options->verbose) {
+        printf("Done!\n");
+    }
+
+    result->time_total = wall_time() - start_total;
+    result->time_hf = phases->time[PHASE_HF];
+    result->time_mp2 = phases->time[PHASE_MP2];
+    result->time_setup = result->time_total - (result->time_hf + result->time_mp2);
+    result->status = 0;
+    return 0;
+}
@@ -3,10 +3,37 @@
  * @brief Contains the functions associated with the HF and MP2 energy calculation.
  */
 
-#include <stdio.h>
-
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "headers.h"
+
+/**
+ * @brief First work item of a reduction block
+ *
+ * The work is split into REDUCTION_BLOCKS blocks independently of the number of
+ * threads, so the partial sums and their order never depend on the thread count.
+ * @param block Block number, REDUCTION_BLOCKS gives the end of the last block
+ * @param n_items Total number of work items
+ * @return Index of the first item of the block
+ */
+static int64_t block_start(int block, int64_t n_items) {
+    return (int64_t) block * n_items / REDUCTION_BLOCKS;
+}
+
+/**
+ * @brief Sums the partial results of all reduction blocks in a fixed order
+ * @param partial Array of REDUCTION_BLOCKS partial sums
+ * @return Sum of the partial results
+ */
+static double sum_blocks(const double* partial) {
+    double sum = 0;
+    for (int block = 0; block < REDUCTION_BLOCKS; block++) {
+        sum += partial[block];
+    }
+    return sum;
+}
 
 /**
  * @brief Calculates the one-electron energy contribution to the Hartree-Fock energy
@@ -25,42 +52,68 @@ double one_electron_energy(double* data, int32_t n_up, int32_t mo_num){
     return one_el_energy;
 }
 
+/**
+ * @brief Packs the indices of two-electron integrals in place
+ *
+ * The four 32-bit indices of every integral, as read from TREXIO, are replaced by one
+ * packed_index. The packed indices occupy the first half of the array, so the
+ * buffer can be reused without additional memory. All orbital indices must be
+ * smaller than MAX_PACKED_MO_NUM.
+ * @param index Array containing four-index combinations, overwritten
+ * @param n_integrals Number of integrals in the array
+ * @return The array reinterpreted as packed indices
+ */
+packed_index* pack_indices(int32_t* index, int64_t n_integrals) {
+    char* buffer = (char*) index; // Byte-wise access, the packed entry n never overlaps an unread entry
+    for (int64_t n = 0; n < n_integrals; n++) {
+        int32_t entry[4];
+        memcpy(entry, buffer + n * sizeof(entry), sizeof(entry));
+        packed_index packed = PACK_INDEX(entry[0], entry[1], entry[2], entry[3]);
+        memcpy(buffer + n * sizeof(packed_index), &packed, sizeof(packed_index));
+    }
+    return (packed_index*) index;
+}
+
 /**
  * @brief Calculates the two-electron energy contribution to the Hartree-Fock energy
- * @param index Array containing four-index combinations for two-electron integrals
+ *
+ * Each stored integral is classified independently of its position in the list, so
+ * the result does not depend on the ordering of the file, and the contributions of
+ * consecutive chunks or of the oooo class alone can simply be summed up.
+ * @param index Array containing packed four-index combinations for two-electron integrals
  * @param value Array containing values of two-electron integrals
  * @param n_up Number of occupied orbitals
- * @param n_integrals Total number of two-electron integrals
+ * @param n_integrals Number of two-electron integrals in the arrays
  * @return Two-electron energy contribution
  */
-double two_electron_energy(int32_t* index, double* value, int32_t n_up, int64_t n_integrals) {
-    // printf("\nTwo-electron integrals:\n       i  j  k  l     value\n");
-    double two_el_energy = 0;
-    for (int n=0; n < n_integrals; n++) { //! Iterate over the stored integrals
-        // Get the indices
-        int i = index[4*n]; 
-        int j = index[4*n+1];
-        int k = index[4*n+2]; 
-        int l = index[4*n+3];
-        if (i < n_up && j < n_up) { // Check if the first two indices belong to occupied orbitals
-            if (i == j && j == k && k == l) {
-                two_el_energy += value[n]; // if all indices are the same, only add once
-                // printf("2J-K: %2d %2d %2d %2d    %9.6lf\n", i+1, j+1, k+1, l+1, value[n]);
+double two_electron_energy(const packed_index* index, const double* value, int32_t n_up, int64_t n_integrals) {
+    double partial[REDUCTION_BLOCKS]; // Partial sums of the reduction blocks
+    #pragma omp parallel for schedule(dynamic)
+    for (int block = 0; block < REDUCTION_BLOCKS; block++) {
+        double two_el_energy = 0;
+        for (int64_t n = block_start(block, n_integrals); n < block_start(block + 1, n_integrals); n++) {
+            int i = UNPACK_INDEX(index[n], 0);
+            int j = UNPACK_INDEX(index[n], 1);
+            int k = UNPACK_INDEX(index[n], 2);
+            int l = UNPACK_INDEX(index[n], 3);
+            if (i >= n_up || j >= n_up || k >= n_up || l >= n_up) {
+                continue; // Only integrals over occupied orbitals contribute
             }
-            else if (k == i && l ==j) {
-                two_el_energy += (2 * 2 * value[n]); // Add x2 the Coulomb integral, *2 for permutational symmetry
-                // printf("J:    %2d %2d %2d %2d    %9.6lf\n", i+1, j+1, k+1, l+1, value[n]);
+            if (i == k && j == l) { // Coulomb integral <ij|ij>
+                if (i == j) {
+                    two_el_energy += value[n]; // 2J - K with K = J if both orbitals are the same
+                }
+                else {
+                    two_el_energy += 2 * 2 * value[n]; // Add x2 the Coulomb integral, *2 for the pair (j,i)
+                }
             }
-            else if (i == j && k == l) {
-                two_el_energy -= 2 * value[n]; //! Substract the exchange integral, *2 for permutational symmetry
-                // printf("K:    %2d %2d %2d %2d    %9.6lf\n", i+1, j+1, k+1, l+1, value[n]);
+            else if ((i == l && j == k) || (i == j && k == l)) { // Exchange integral <ij|ji> or <ii|jj>
+                two_el_energy -= 2 * value[n]; // Substract the exchange integral, *2 for the pair (j,i)
             }
         }
-        else if (l >= n_up) {
-            break; // Break the loop once there are only integrals with virtual orbitals in the list
-        }
+        partial[block] = two_el_energy;
     }
-    return two_el_energy;
+    return sum_blocks(partial);
 }
 
 /**
@@ -75,64 +128,325 @@ double hartree_fock_energy(double nuc_repul, double one_el_energy, double two_el
 }
 
 /**
- * @brief Retrieves integral value
+ * @brief Compound index of an unordered pair of orbital indices
+ * @param p First index
+ * @param q Second index
+ * @return Triangular index of the pair
+ */
+static uint64_t pair_index(uint64_t p, uint64_t q) {
+    return (p >= q) ? p * (p + 1) / 2 + q : q * (q + 1) / 2 + p;
+}
+
+/**
+ * @brief Canonical key of a two-electron integral <ij|kl>
+ *
+ * The key is identical for all eight permutations of the indices that leave the
+ * value of a real integral unchanged.
  * @param i First index
  * @param j Second index
  * @param k Third index
  * @param l Fourth index
- * @param index Array containing four-index combinations
+ * @return Canonical compound index
+ */
+uint64_t integral_key(int i, int j, int k, int l) {
+    // <ij|kl> = (ik|jl), combine the two charge distributions
+    return pair_index(pair_index(i, k), pair_index(j, l));
+}
+
+/**
+ * @brief Hash slot of a canonical key
+ * @param key Canonical compound index
+ * @param capacity Number of slots of the store (power of two)
+ * @return Starting slot for the probe sequence
+ */
+static int64_t integral_slot(uint64_t key, int64_t capacity) {
+    uint64_t hash = key * 0x9E3779B97F4A7C15ULL; // Fibonacci hashing
+    hash ^= hash >> 32;
+    return (int64_t) (hash & (uint64_t) (capacity - 1));
+}
+
+/**
+ * @brief Builds the hash-indexed store of two-electron integrals
+ *
+ * The store must be zero-initialized before its first use.
+ * @param store Integral store to fill
+ * @param index Array containing packed four-index combinations
  * @param value Array containing integral values
  * @param n_integrals Total number of integrals
+ * @return 0 on success, -1 if memory allocation fails
+ */
+int build_integral_store(integral_store* store, const packed_index* index, const double* value, int64_t n_integrals) {
+    // Keep the load factor at or below 0.5 so that probe sequences stay short
+    int64_t capacity = 16;
+    while (capacity < 2 * n_integrals) {
+        capacity *= 2;
+    }
+
+    // Reuse the arrays of a previous build if they are large enough
+    if (store->allocated < capacity) {
+        free_integral_store(store);
+        store->keys = malloc(capacity * sizeof(uint64_t));
+        store->values = malloc(capacity * sizeof(double));
+        if (store->keys == NULL || store->values == NULL) {
+            free_integral_store(store);
+            return -1;
+        }
+        store->allocated = capacity;
+    }
+    store->capacity = capacity;
+    store->count = 0;
+    for (int64_t n = 0; n < capacity; n++) {
+        store->keys[n] = EMPTY_KEY;
+    }
+
+    for (int64_t n = 0; n < n_integrals; n++) { // Insert every stored integral
+        uint64_t key = integral_key(UNPACK_INDEX(index[n], 0), UNPACK_INDEX(index[n], 1),
+                                    UNPACK_INDEX(index[n], 2), UNPACK_INDEX(index[n], 3));
+        int64_t slot = integral_slot(key, capacity);
+        while (store->keys[slot] != EMPTY_KEY && store->keys[slot] != key) {
+            slot = (slot + 1) & (capacity - 1); // Linear probing
+        }
+        if (store->keys[slot] == EMPTY_KEY) {
+            store->keys[slot] = key;
+            store->count++;
+        }
+        store->values[slot] = value[n];
+    }
+    return 0;
+}
+
+/**
+ * @brief Retrieves integral value
+ * @param store Integral store
+ * @param i First index
+ * @param j Second index
+ * @param k Third index
+ * @param l Fourth index
  * @return Value of the requested integral or 0.0 if not found
  */
-double get_integral(int i, int j, int k, int l, const int32_t* index, const double* value, int64_t n_integrals) {
-    for (int64_t n = 0; n < n_integrals; n++) { // Try both possible permutations       
-        if ((index[4*n] == i && index[4*n+1] == j && index[4*n+2] == k && index[4*n+3] == l) ||
-            (index[4*n] == j && index[4*n+1] == i && index[4*n+2] == l && index[4*n+3] == k)) {
-            return value[n];
+double get_integral(const integral_store* store, int i, int j, int k, int l) {
+    uint64_t key = integral_key(i, j, k, l);
+    int64_t slot = integral_slot(key, store->capacity);
+    while (store->keys[slot] != EMPTY_KEY) { // Probe until the key or a free slot is found
+        if (store->keys[slot] == key) {
+            return store->values[slot];
         }
+        slot = (slot + 1) & (store->capacity - 1);
     }
     return 0.0;
 }
 
 /**
- * @brief MP2 energy correction calculation
- * @param index Array containing four-index combinations
+ * @brief Frees the memory held by an integral store
+ * @param store Integral store
+ */
+void free_integral_store(integral_store* store) {
+    free(store->keys);
+    free(store->values);
+    store->keys = NULL;
+    store->values = NULL;
+    store->capacity = 0;
+    store->allocated = 0;
+    store->count = 0;
+}
+
+/**
+ * @brief Occupancy class of a two-electron integral
+ * @param i First index
+ * @param j Second index
+ * @param k Third index
+ * @param l Fourth index
+ * @param n_up Number of occupied orbitals
+ * @return Class of <ij|kl> = (ik|jl), identical for all symmetry-equivalent permutations
+ */
+integral_class classify_integral(int i, int j, int k, int l, int32_t n_up) {
+    int n_virtual = (i >= n_up) + (j >= n_up) + (k >= n_up) + (l >= n_up); // Number of virtual indices
+    switch (n_virtual) {
+        case 0:
+            return CLASS_OOOO;
+        case 1:
+            return CLASS_OOOV;
+        case 2:
+            // (oo|vv) if i and k have the same occupancy, (ov|ov) otherwise
+            return ((i >= n_up) == (k >= n_up)) ? CLASS_OOVV : CLASS_OVOV;
+        case 3:
+            return CLASS_OVVV;
+        default:
+            return CLASS_VVVV;
+    }
+}
+
+/**
+ * @brief Bucket-sorts the two-electron integrals by occupancy class
+ *
+ * The integrals of each class are stored contiguously, so every kernel only visits
+ * the class it needs. The buckets must be zero-initialized before the first use;
+ * their arrays are reused when they are large enough.
+ * @param index Array containing packed four-index combinations
  * @param value Array containing integral values
+ * @param n_integrals Total number of integrals
+ * @param n_up Number of occupied orbitals
+ * @param buckets Buckets to fill
+ * @return 0 on success, -1 if memory allocation fails
+ */
+int sort_integrals_by_class(const packed_index* index, const double* value, int64_t n_integrals,
+                            int32_t n_up, integral_buckets* buckets) {
+    if (buckets->allocated < n_integrals || buckets->index == NULL) {
+        free_integral_buckets(buckets);
+        buckets->index = malloc((n_integrals > 0 ? n_integrals : 1) * sizeof(packed_index));
+        buckets->value = malloc((n_integrals > 0 ? n_integrals : 1) * sizeof(double));
+        if (buckets->index == NULL || buckets->value == NULL) {
+            free_integral_buckets(buckets);
+            return -1;
+        }
+        buckets->allocated = n_integrals;
+    }
+
+    // Count the integrals of every class
+    int64_t count[N_CLASSES] = {0};
+    for (int64_t n = 0; n < n_integrals; n++) {
+        count[classify_integral(UNPACK_INDEX(index[n], 0), UNPACK_INDEX(index[n], 1),
+                                UNPACK_INDEX(index[n], 2), UNPACK_INDEX(index[n], 3), n_up)]++;
+    }
+
+    // The buckets follow each other in the order of the classes
+    int64_t position[N_CLASSES]; // Next free position in every bucket
+    buckets->start[0] = 0;
+    for (int c = 0; c < N_CLASSES; c++) {
+        position[c] = buckets->start[c];
+        buckets->start[c + 1] = buckets->start[c] + count[c];
+    }
+
+    // Move the integrals into their buckets, keeping their relative order
+    for (int64_t n = 0; n < n_integrals; n++) {
+        int c = classify_integral(UNPACK_INDEX(index[n], 0), UNPACK_INDEX(index[n], 1),
+                                  UNPACK_INDEX(index[n], 2), UNPACK_INDEX(index[n], 3), n_up);
+        int64_t p = position[c]++;
+        buckets->index[p] = index[n];
+        buckets->value[p] = value[n];
+    }
+    return 0;
+}
+
+/**
+ * @brief Frees the memory held by the integral buckets
+ * @param buckets Integral buckets
+ */
+void free_integral_buckets(integral_buckets* buckets) {
+    free(buckets->index);
+    free(buckets->value);
+    buckets->index = NULL;
+    buckets->value = NULL;
+    buckets->allocated = 0;
+}
+
+/**
+ * @brief MP2 energy correction calculation
+ * @param store Integral store containing the two-electron integrals
  * @param mo_energy Array of molecular orbital energies
  * @param n_up Number of occupied orbitals
- * @param n_integrals Total number of integrals
+ * @param mo_num Total number of molecular orbitals
  * @return MP2 energy correction
  */
-double MP2_energy_correction(int32_t* index, double* value, double* mo_energy, int32_t n_up, int64_t n_integrals) { 
-    double MP2_energy = 0; 
-    double ijab = 0; 
-    double ijba = 0;
-    double denominator = 0; 
-    double symmetry = 0; 
-    for (int n=0; n < n_integrals; n++) { //Iterate over the stored integrals
-        // Get the indices
-        int i = index[4*n]; 
-        int j = index[4*n+1]; 
-        int a = index[4*n+2];
-        int b = index[4*n+3];
-        // Use <ij|ab> = <ab|ij> 
-        // Check if the first two indices belong to virtual orbitals and the last two to occupied
-        if (i >= n_up && j >= n_up && a < n_up && b < n_up) { 
-            ijab = value[n];
-            //printf("ijab: %2d %2d %2d %2d    %9.6lf\n", i+1, j+1, a+1, b+1, ijab);
-            denominator = mo_energy[a] + mo_energy[b] - mo_energy[i] - mo_energy[j];
-            ijba = get_integral(i, j, b, a, index, value, n_integrals);      
-            // Account for permutational symmetry of two-electron integrals
-	    if (i == j && a == b) {
-                symmetry = 1.0;
+double MP2_energy_correction(const integral_store* store, double* mo_energy, int32_t n_up, int32_t mo_num) {
+    int64_t n_pairs = (int64_t) n_up * n_up; // Pairs of occupied orbitals
+    double partial[REDUCTION_BLOCKS]; // Partial sums of the reduction blocks
+    #pragma omp parallel for schedule(dynamic)
+    for (int block = 0; block < REDUCTION_BLOCKS; block++) {
+        double MP2_energy = 0;
+        for (int64_t ij = block_start(block, n_pairs); ij < block_start(block + 1, n_pairs); ij++) {
+            int i = ij / n_up; // Pair of occupied orbitals
+            int j = ij % n_up;
+            for (int a = n_up; a < mo_num; a++) { // Iterate over pairs of virtual orbitals
+                for (int b = n_up; b < mo_num; b++) {
+                    double ijab = get_integral(store, i, j, a, b);
+                    double ijba = get_integral(store, i, j, b, a);
+                    double denominator = mo_energy[i] + mo_energy[j] - mo_energy[a] - mo_energy[b];
+                    MP2_energy += (ijab * (2.0 * ijab - ijba)) / denominator;
+                }
+            }
+        }
+        partial[block] = MP2_energy;
+    }
+    return sum_blocks(partial);
+}
+
+/**
+ * @brief Extracts the occupied-virtual block (ia|jb) of the two-electron integrals
+ *
+ * Every stored integral is expanded over its symmetry-equivalent permutations and
+ * written to the dense block wherever it is of the form (ia|jb) with i, j occupied
+ * and a, b virtual. The block is laid out as block[((i*n_virt + a)*n_up + j)*n_virt + b]
+ * and must be zero-initialized by the caller, so it can be filled chunk by chunk.
+ * @param index Array containing packed four-index combinations
+ * @param value Array containing integral values
+ * @param n_integrals Number of integrals in the arrays
+ * @param n_up Number of occupied orbitals
+ * @param mo_num Total number of molecular orbitals
+ * @param block Dense (ia|jb) block of size n_up*n_virt*n_up*n_virt
+ */
+void extract_ovov_block(const packed_index* index, const double* value, int64_t n_integrals,
+                        int32_t n_up, int32_t mo_num, double* block) {
+    int64_t n_virt = mo_num - n_up;
+    // Symmetry-distinct integrals never share a position in the block, so the loop can be split freely
+    #pragma omp parallel for schedule(static)
+    for (int64_t n = 0; n < n_integrals; n++) {
+        // <pq|rs> = (pr|qs), the charge distributions are (pr) and (qs)
+        int p = UNPACK_INDEX(index[n], 0);
+        int q = UNPACK_INDEX(index[n], 1);
+        int r = UNPACK_INDEX(index[n], 2);
+        int s = UNPACK_INDEX(index[n], 3);
+        // The four orientations of the two charge distributions, each used in both orders
+        int pairs[4][4] = {{p, r, q, s}, {r, p, q, s}, {p, r, s, q}, {r, p, s, q}};
+        for (int m = 0; m < 4; m++) {
+            for (int swap = 0; swap < 2; swap++) {
+                int i = pairs[m][2*swap];
+                int a = pairs[m][2*swap+1];
+                int j = pairs[m][2*(1-swap)];
+                int b = pairs[m][2*(1-swap)+1];
+                if (i < n_up && j < n_up && a >= n_up && b >= n_up) {
+                    block[((i * n_virt + (a - n_up)) * n_up + j) * n_virt + (b - n_up)] = value[n];
+                }
             }
-            else {
-                symmetry = 2.0;
+        }
+    }
+}
+
+/**
+ * @brief MP2 energy correction from the dense (ia|jb) block
+ *
+ * The exchange integral (ib|ja) equals (ja|ib), so for fixed i, a and j both the
+ * Coulomb and the exchange rows are contiguous in b and the inner loop streams
+ * through memory.
+ * @param block Dense (ia|jb) block as filled by extract_ovov_block
+ * @param mo_energy Array of molecular orbital energies
+ * @param n_up Number of occupied orbitals
+ * @param mo_num Total number of molecular orbitals
+ * @return MP2 energy correction
+ */
+double MP2_energy_dense(const double* block, const double* mo_energy, int32_t n_up, int32_t mo_num) {
+    int64_t n_virt = mo_num - n_up;
+    int64_t n_rows = n_up * n_virt * n_up; // Rows (i,a,j) of the block
+    const double* virt_energy = mo_energy + n_up; // Energies of the virtual orbitals
+    double partial[REDUCTION_BLOCKS]; // Partial sums of the reduction blocks
+    #pragma omp parallel for schedule(dynamic)
+    for (int r = 0; r < REDUCTION_BLOCKS; r++) {
+        double MP2_energy = 0;
+        for (int64_t row = block_start(r, n_rows); row < block_start(r + 1, n_rows); row++) {
+            int64_t i = row / (n_virt * n_up);
+            int64_t a = (row / n_up) % n_virt;
+            int64_t j = row % n_up;
+            const double* coulomb = block + row * n_virt; // (ia|jb)
+            const double* exchange = block + ((j * n_virt + a) * n_up + i) * n_virt; // (ja|ib)
+            double pair_energy = mo_energy[i] + mo_energy[j] - virt_energy[a]; // Denominator without e_b
+            double row_energy = 0;
+            #pragma omp simd reduction(+:row_energy)
+            for (int b = 0; b < n_virt; b++) {
+                row_energy += coulomb[b] * (2.0 * coulomb[b] - exchange[b]) / (pair_energy - virt_energy[b]);
             }
-            // Add integrals to MP2 correction
-            MP2_energy += symmetry * ((ijab * (2.0 * ijab - ijba))/denominator);
-        }  
+            MP2_energy += row_energy;
+        }
+        partial[r] = MP2_energy;
     }
-    return MP2_energy;
+    return sum_blocks(partial);
 }
@@ -6,12 +6,237 @@
 #ifndef FUNCTIONS_H
 #define FUNCTIONS_H
 
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <trexio.h>
+
+#define EMPTY_KEY UINT64_MAX // Marks a free slot in the integral store
+#define REDUCTION_BLOCKS 256 // Fixed number of blocks of the deterministic parallel sums
+#define MAX_PACKED_MO_NUM 65536 // Orbital indices of packed integrals must fit into 16 bits
+
+/**
+ * @brief Four orbital indices of a two-electron integral <ij|kl>, 16 bits each
+ *
+ * i is stored in the lowest 16 bits, followed by j, k and l, so one integral takes
+ * 8 bytes of indices instead of 16.
+ */
+typedef uint64_t packed_index;
+
+#define PACK_INDEX(i, j, k, l) ((packed_index) (i) | (packed_index) (j) << 16 | \
+                                (packed_index) (k) << 32 | (packed_index) (l) << 48)
+#define UNPACK_INDEX(packed, m) ((int) (((packed) >> (16 * (m))) & 0xFFFF)) // m-th index, 0 to 3
+
+/**
+ * @brief Open-addressing hash table of two-electron integrals
+ *
+ * Integrals are indexed by a canonical key that is shared by all eight
+ * symmetry-equivalent index permutations, so any permutation can be queried.
+ */
+typedef struct {
+    uint64_t* keys; //! Canonical keys of the stored integrals
+    double* values; //! Values of the stored integrals
+    int64_t capacity; //! Number of slots in use, always a power of two
+    int64_t allocated; //! Number of allocated slots, kept when the store is rebuilt
+    int64_t count; //! Number of distinct integrals in the store
+} integral_store;
+
+/**
+ * @brief Occupancy classes of two-electron integrals (ik|jl) in chemists' notation
+ */
+typedef enum {
+    CLASS_OOOO, //! Only occupied orbitals, needed for the HF energy
+    CLASS_OOOV, //! One virtual orbital
+    CLASS_OOVV, //! (oo|vv), two virtual orbitals in the same charge distribution
+    CLASS_OVOV, //! (ov|ov), the integrals needed for the MP2 energy
+    CLASS_OVVV, //! Three virtual orbitals
+    CLASS_VVVV, //! Only virtual orbitals
+    N_CLASSES
+} integral_class;
+
+/**
+ * @brief Two-electron integrals bucket-sorted by occupancy class
+ *
+ * The integrals of class c are stored at positions start[c] to start[c+1]-1.
+ */
+typedef struct {
+    packed_index* index; //! Packed indices of the sorted integrals
+    double* value; //! Values of the sorted integrals
+    int64_t allocated; //! Number of integrals the arrays can hold
+    int64_t start[N_CLASSES + 1]; //! First position of every class
+} integral_buckets;
+
+/**
+ * @brief Double-buffered reader streaming the two-electron integrals from a TREXIO file
+ *
+ * A reader thread fills one buffer while the consumer works on the other one.
+ */
+typedef struct {
+    trexio_t* file; //! TREXIO file handle
+    int64_t n_integrals; //! Total number of integrals in the file
+    int64_t chunk_size; //! Maximum number of integrals per chunk
+    int64_t capacity; //! Number of integrals the buffers can hold, kept between runs
+    int32_t* index[2]; //! Index buffers, packed in place by the reader thread
+    double* value[2]; //! Value buffers
+    int64_t count[2]; //! Number of integrals in each buffer, 0 at the end, -1 on error
+    int full[2]; //! Defines whether a buffer holds a chunk not yet released by the consumer
+    int current; //! Buffer held by the consumer, -1 before the first chunk
+    trexio_exit_code rc; //! Return code of the failed read, TREXIO_SUCCESS otherwise
+    int64_t error_offset; //! Offset of the failed read
+    double read_time; //! Wall-clock time spent in TREXIO reads
+    double wait_time; //! Wall-clock time the consumer spent waiting for data
+    pthread_t thread; //! Reader thread
+    pthread_mutex_t lock; //! Protects count and full
+    pthread_cond_t cond; //! Signals changes of count and full
+} eri_reader;
+
+/**
+ * @brief Phases of a calculation measured by the instrumentation
+ */
+typedef enum {
+    PHASE_OPEN, //! Opening the TREXIO file
+    PHASE_METADATA, //! Reading the system sizes and orbital energies
+    PHASE_ONE_E_READ, //! Reading the one-electron integrals
+    PHASE_ERI_READ, //! Reading the two-electron integrals
+    PHASE_PREPARE, //! Sorting and indexing the two-electron integrals
+    PHASE_HF, //! HF energy
+    PHASE_MP2, //! MP2 energy correction
+    PHASE_CLOSE, //! Closing the TREXIO file
+    N_PHASES
+} phase_id;
+
+/**
+ * @brief Hardware counters recorded for every phase
+ */
+typedef enum {
+    COUNTER_CYCLES, //! CPU cycles
+    COUNTER_CACHE_MISSES, //! Last-level cache misses
+    N_COUNTERS
+} counter_id;
+
+/**
+ * @brief Timer measuring wall-clock time and hardware counters of the phases
+ */
+typedef struct {
+    int initialized; //! Defines whether init_phase_timer was called
+    int counters; //! Defines whether the hardware counters are open
+    int fd[N_COUNTERS]; //! perf_event file descriptors, -1 if closed
+    double start_time; //! Wall-clock time at the start of the current phase
+    uint64_t start_count[N_COUNTERS]; //! Counter values at the start of the current phase
+} phase_timer;
+
+/**
+ * @brief Time, bytes read and hardware counts of every phase of a calculation
+ */
+typedef struct {
+    double time[N_PHASES]; //! Wall-clock time of every phase
+    int64_t bytes[N_PHASES]; //! Bytes read from the file in every phase
+    uint64_t counts[N_PHASES][N_COUNTERS]; //! Hardware counts of every phase
+} phase_stats;
+
+/**
+ * @brief Options of a HF and MP2 calculation
+ */
+typedef struct {
+    int dense_mp2; //! Defines whether the dense (ia|jb) MP2 kernel should be used
+    int64_t chunk_size; //! Number of integrals read at once when streaming, 0 reads all at once
+    int verbose; //! Defines whether progress messages are printed
+    int hw_counters; //! Defines whether hardware counters should be recorded for every phase
+} calc_options;
+
+/**
+ * @brief Energies, system information and timings of a HF and MP2 calculation
+ */
+typedef struct {
+    int status; //! 0 if the calculation succeeded
+    double nuc_repul; //! Nuclear repulsion energy
+    double one_el_energy; //! One-electron energy contribution
+    double two_el_energy; //! Two-electron energy contribution
+    double HF_energy; //! Hartree-Fock energy
+    double MP2_energy; //! MP2 energy correction
+    int32_t n_up; //! Number of occupied orbitals
+    int32_t mo_num; //! Number of molecular orbitals
+    int64_t n_integrals; //! Number of non-zero two-electron integrals
+    int dense_mp2; //! Defines whether the dense MP2 kernel was used
+    int64_t chunk_size; //! Number of integrals per streamed chunk, 0 if not streamed
+    double time_hf; //! Wall-clock time of the HF calculation
+    double time_mp2; //! Wall-clock time of the MP2 calculation
+    double time_setup; //! Wall-clock time of I/O and setup
+    double time_total; //! Total wall-clock time
+    double io_read_time; //! Time the reader thread spent reading integrals
+    double io_wait_time; //! Time the computation spent waiting for the reader thread
+    int hw_counters; //! Defines whether the phases include hardware counts
+    phase_stats phases; //! Time, bytes read and hardware counts of every phase
+} calc_result;
+
+/**
+ * @brief Buffers reused by consecutive calculations
+ *
+ * Buffers only grow, so processing many molecules does not reallocate memory
+ * for every file.
+ */
+typedef struct {
+    double* mo_energy; //! Molecular orbital energies
+    size_t mo_energy_size; //! Allocated bytes of mo_energy
+    double* data; //! One-electron integrals
+    size_t data_size; //! Allocated bytes of data
+    int32_t* index; //! Indices of the two-electron integrals, packed in place after reading
+    size_t index_size; //! Allocated bytes of index
+    double* value; //! Values of the two-electron integrals
+    size_t value_size; //! Allocated bytes of value
+    double* ovov_block; //! Dense (ia|jb) block of the two-electron integrals
+    size_t ovov_block_size; //! Allocated bytes of ovov_block
+    integral_buckets buckets; //! Two-electron integrals sorted by occupancy class
+    integral_store store; //! Hash-indexed store of the (ov|ov) integrals
+    eri_reader reader; //! Reader for streaming the two-electron integrals
+    phase_timer timer; //! Timer of the calculation phases
+} calc_workspace;
+
+extern pthread_mutex_t trexio_lock;
+
 double one_electron_energy(double* data, int32_t n_up, int32_t mo_num);
-double two_electron_energy(int32_t* index, double* value, int32_t n_up, int64_t n_integrals);
+double two_electron_energy(const packed_index* index, const double* value, int32_t n_up, int64_t n_integrals);
 double hartree_fock_energy(double nuc_repul, double one_el_energy, double two_el_energy);
 
-double get_integral(int i, int j, int k, int l, const int32_t* index, const double* value, int64_t n_integrals);
-double MP2_energy_correction(int32_t* index, double* value, double* mo_energy, int32_t n_up, int64_t n_integrals);
+packed_index* pack_indices(int32_t* index, int64_t n_integrals);
+uint64_t integral_key(int i, int j, int k, int l);
+int build_integral_store(integral_store* store, const packed_index* index, const double* value, int64_t n_integrals);
+double get_integral(const integral_store* store, int i, int j, int k, int l);
+void free_integral_store(integral_store* store);
+integral_class classify_integral(int i, int j, int k, int l, int32_t n_up);
+int sort_integrals_by_class(const packed_index* index, const double* value, int64_t n_integrals,
+                            int32_t n_up, integral_buckets* buckets);
+void free_integral_buckets(integral_buckets* buckets);
+double MP2_energy_correction(const integral_store* store, double* mo_energy, int32_t n_up, int32_t mo_num);
+
+void extract_ovov_block(const packed_index* index, const double* value, int64_t n_integrals,
+                        int32_t n_up, int32_t mo_num, double* block);
+double MP2_energy_dense(const double* block, const double* mo_energy, int32_t n_up, int32_t mo_num);
+
+int eri_reader_start(eri_reader* reader, trexio_t* file, int64_t n_integrals, int64_t chunk_size);
+int64_t eri_reader_next(eri_reader* reader, const packed_index** index, const double** value);
+trexio_exit_code eri_reader_finish(eri_reader* reader);
+void free_eri_reader(eri_reader* reader);
+
+double wall_time(void);
+const char* phase_name(phase_id phase);
+int init_phase_timer(phase_timer* timer, int counters);
+void close_phase_timer(phase_timer* timer);
+void phase_begin(phase_timer* timer);
+void phase_end(phase_timer* timer, phase_stats* stats, phase_id phase);
+void write_json_string(FILE* out, const char* text);
+void write_trace_json(FILE* out, char** files, const calc_result* results, int n_files, int n_threads, int counters);
+
+void init_workspace(calc_workspace* work);
+void free_workspace(calc_workspace* work);
+int run_calculation(const char* filename, const calc_options* options, calc_workspace* work, calc_result* result);
+
+int collect_inputs(char** paths, int n_paths, char*** files);
+void free_inputs(char** files, int n_files);
+void run_batch(char** files, int n_files, const calc_options* options, int n_workers, int threads_per_worker,
+               calc_result* results);
+void write_results_csv(FILE* out, char** files, const calc_result* results, int n_files);
+void write_results_json(FILE* out, char** files, const calc_result* results, int n_files);
 
 #endif
 
@@ -0,0 +1,197 @@
+/**
+ * @file instrument.c
+ * @brief Contains the wall-clock timers, hardware counters and trace output of the calculation phases.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "headers.h"
+
+static const char* phase_names[N_PHASES] = {
+    "open", "metadata", "one_e_read", "eri_read", "prepare", "hf", "mp2", "close"
+}; //! Names of the phases in the trace
+
+/**
+ * @brief Returns the current wall-clock time
+ * @return Time in seconds from a monotonic clock
+ */
+double wall_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/**
+ * @brief Returns the name of a phase
+ * @param phase Phase of the calculation
+ * @return Name used in the summary and the trace
+ */
+const char* phase_name(phase_id phase) {
+    return phase_names[phase];
+}
+
+/**
+ * @brief Opens the hardware counters for the calling thread
+ *
+ * Only the calling thread is counted, with several OpenMP threads the counts cover
+ * the share of the master thread. If perf_event is unavailable (e.g. not Linux or
+ * not permitted), the timer keeps measuring wall-clock time only.
+ * @param timer Timer to initialize
+ * @param counters Defines whether hardware counters should be used
+ * @return 0 if the requested counters are available, -1 otherwise
+ */
+int init_phase_timer(phase_timer* timer, int counters) {
+    memset(timer, 0, sizeof(*timer));
+    for (int c = 0; c < N_COUNTERS; c++) {
+        timer->fd[c] = -1;
+    }
+    timer->initialized = 1;
+    if (!counters) {
+        return 0;
+    }
+#ifdef __linux__
+    const uint64_t configs[N_COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_CACHE_MISSES};
+    for (int c = 0; c < N_COUNTERS; c++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = configs[c];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        timer->fd[c] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0); // Calling thread, any CPU
+        if (timer->fd[c] < 0) {
+            close_phase_timer(timer);
+            timer->initialized = 1;
+            return -1;
+        }
+    }
+    timer->counters = 1;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * @brief Closes the hardware counters of a timer
+ * @param timer Timer to close
+ */
+void close_phase_timer(phase_timer* timer) {
+#ifdef __linux__
+    for (int c = 0; c < N_COUNTERS; c++) {
+        if (timer->initialized && timer->fd[c] >= 0) {
+            close(timer->fd[c]);
+        }
+    }
+#endif
+    memset(timer, 0, sizeof(*timer));
+    for (int c = 0; c < N_COUNTERS; c++) {
+        timer->fd[c] = -1;
+    }
+}
+
+/**
+ * @brief Reads the current values of the hardware counters
+ * @param timer Timer with open counters
+ * @param values Array receiving N_COUNTERS values
+ */
+static void read_counters(const phase_timer* timer, uint64_t* values) {
+    for (int c = 0; c < N_COUNTERS; c++) {
+        values[c] = 0;
+#ifdef __linux__
+        if (timer->counters && read(timer->fd[c], &values[c], sizeof(uint64_t)) != sizeof(uint64_t)) {
+            values[c] = 0;
+        }
+#endif
+    }
+}
+
+/**
+ * @brief Starts measuring a phase
+ * @param timer Timer of the calling thread
+ */
+void phase_begin(phase_timer* timer) {
+    read_counters(timer, timer->start_count);
+    timer->start_time = wall_time();
+}
+
+/**
+ * @brief Ends measuring a phase and adds the measurement to the statistics
+ * @param timer Timer of the calling thread
+ * @param stats Statistics of the calculation
+ * @param phase Phase that was measured
+ */
+void phase_end(phase_timer* timer, phase_stats* stats, phase_id phase) {
+    stats->time[phase] += wall_time() - timer->start_time;
+    uint64_t count[N_COUNTERS];
+    read_counters(timer, count);
+    for (int c = 0; c < N_COUNTERS; c++) {
+        stats->counts[phase][c] += count[c] - timer->start_count[c];
+    }
+}
+
+/**
+ * @brief Writes a string as a quoted JSON string
+ *
+ * Quotes and backslashes are escaped with a backslash and control characters,
+ * e.g. a newline in a file name, as \\uXXXX, so the output is always valid JSON.
+ * @param out Output stream
+ * @param text String to be written
+ */
+void write_json_string(FILE* out, const char* text) {
+    fputc('"', out);
+    for (const unsigned char* c = (const unsigned char*) text; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', out);
+            fputc(*c, out);
+        }
+        else if (*c < 0x20) {
+            fprintf(out, "\\u%04x", *c);
+        }
+        else {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/**
+ * @brief Writes the phase statistics of many calculations as a JSON trace
+ * @param out Output stream
+ * @param files Processed files
+ * @param results Results, one per file
+ * @param n_files Number of files
+ * @param n_threads Number of threads per calculation
+ * @param counters Defines whether hardware counters were recorded
+ */
+void write_trace_json(FILE* out, char** files, const calc_result* results, int n_files, int n_threads, int counters) {
+    fprintf(out, "{\n  \"program\": \"HF_and_MP2\",\n  \"threads\": %d,\n  \"hw_counters\": %s,\n  \"runs\": [\n",
+            n_threads, counters ? "true" : "false");
+    for (int f = 0; f < n_files; f++) {
+        const calc_result* r = &results[f];
+        fprintf(out, "    {\"file\": ");
+        write_json_string(out, files[f]);
+        fprintf(out, ", \"status\": \"%s\", \"time_total\": %.6f, \"io_wait_time\": %.6f, \"phases\": {",
+                r->status == 0 ? "ok" : "error", r->time_total, r->io_wait_time);
+        for (int p = 0; p < N_PHASES; p++) {
+            fprintf(out, "%s\n      \"%s\": {\"time\": %.6f, \"bytes\": %ld", p > 0 ? "," : "",
+                    phase_names[p], r->phases.time[p], r->phases.bytes[p]);
+            if (counters) {
+                fprintf(out, ", \"cycles\": %lu, \"cache_misses\": %lu",
+                        r->phases.counts[p][COUNTER_CYCLES], r->phases.counts[p][COUNTER_CACHE_MISSES]);
+            }
+            fprintf(out, "}");
+        }
+        fprintf(out, "}}%s\n", f + 1 < n_files ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
@@ -6,241 +6,296 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <trexio.h>
-#include <time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "headers.h" // Function headers
 
-int main(int argc, char *argv[]) {
-    // Start timing the entire program
-    clock_t start_total = clock();
-    clock_t start_hf, end_hf, start_mp2, end_mp2;
-
-    char* filename; //! Name of the HDF5 file
-
-    // Check if a HDF5 file was specified as argument
-    if (argc != 2) {
-        fprintf(stderr, "No HDF5 file containing the data was specified. You can do so by using the program as follows: ./HF 'path/to/hdf5' or by providing the path for your file below:\nPath to HDF5 file: ");
-        scanf("%s", filename);
-    }
-    else if (argc == 2) {
-        filename = argv[1];
-    }
-
-    // Greet the user
-    // Start with an ASCII art of the program name
-    printf(" ___  ___  ________      _____ ______   ________    _______     \n");
-    printf("|\\  \\|\\  \\|\\  _____\\    |\\   _ \\  _   \\|\\   __  \\  /  ___  \\    \n");
-    printf("\\ \\  \\\\\\  \\ \\  \\__/     \\ \\  \\\\\\__\\ \\  \\ \\  \\|\\  \\/__/|_/  /|   \n");
-    printf(" \\ \\   __  \\ \\   __\\     \\ \\  \\\\|__| \\  \\ \\   ____\\__|//  / /   \n");
-    printf("  \\ \\  \\ \\  \\ \\  \\_|      \\ \\  \\    \\ \\  \\ \\  \\___|   /  /_/__  \n");
-    printf("   \\ \\__\\ \\__\\ \\__\\        \\ \\__\\    \\ \\__\\ \\__\\     |\\________\\\n");
-    printf("    \\|__|\\|__|\\|__|         \\|__|     \\|__|\\|__|      \\|_______|\n");
-    printf("\nWelcome to the Hartree-Fock and MP2 energy calculation program.\n");
-
-    // Open TREXIO file for reading the data
-    trexio_exit_code rc; //! TREXIO output
-    trexio_t* trexio_file = trexio_open(filename, 'r', TREXIO_AUTO, &rc); //! TREXIO file handler
-    if (rc != TREXIO_SUCCESS) {
-        fprintf(stderr, "TREXIO Error: %s\n", trexio_string_of_error(rc));
-        exit(1);
-    }
-
-    // Read the nuclear repulsion energy
-    double nuc_repul; //! Nuclear repulsion energy
-    rc = trexio_read_nucleus_repulsion(trexio_file, &nuc_repul);
-    if (rc != TREXIO_SUCCESS) {
-        fprintf(stderr, "TREXIO Error reading nuclear repulsion energy:\n%s\n",
-                trexio_string_of_error(rc));
-        exit(1);
-    }
-
-    // Obtain the number of occupied orbitals
-    int32_t n_up; //! Number of spin-up electrons
-    rc = trexio_read_electron_up_num(trexio_file, &n_up);
-    if (rc != TREXIO_SUCCESS) {
-        fprintf(stderr, "TREXIO Error reading number of spin-up electrons: n%s\n",
-                trexio_string_of_error(rc));
-        exit(1);
-    }
-
-    // Obtain the number of molecular orbitals
-    int32_t mo_num; //! Number of molecular orbitals
-    rc = trexio_read_mo_num(trexio_file, &mo_num);
-    if (rc != TREXIO_SUCCESS) {
-        fprintf(stderr, "TREXIO Error reading number of molecular orbitals: n%s\n",
-                trexio_string_of_error(rc));
-        exit(1);
-    }
-
-    // Allocate array for orbital energies
-    double* mo_energy = malloc(mo_num * sizeof(double)); //! Array of molecular orbital energies
-    if (mo_energy == NULL) {
-        fprintf(stderr, "Failed to allocate memory for orbital energies\n");
-        exit(1);
-    }
-    // Read in the orbital energies
-    rc = trexio_read_mo_energy(trexio_file, mo_energy);
-    if (rc != TREXIO_SUCCESS) {
-        fprintf(stderr, "Error reading orbital energies: %s\n", 
-                trexio_string_of_error(rc));
-        free(mo_energy);
-        exit(1);
-    }
-
-    // Read in the one-electron integrals
-
-    int64_t elements = mo_num * mo_num; //! Number of elements in the data array
-
-    double* data = malloc(elements * sizeof(double)); //! Array of one-electron integrals
-    if (data == NULL) {
-        fprintf(stderr, "Allocation of data array for one-electron integrals failed\n");
-        free(mo_energy);
-        exit(-1);
-    }
-    // Use TREXIO function to fill data array with one-electron integrals
-    rc = trexio_read_mo_1e_int_core_hamiltonian(trexio_file, data);
-    // Check the return code to be sure reading was OK
-    if (rc != TREXIO_SUCCESS) {
-        fprintf(stderr, "TREXIO Error reading one-electron integrals: n%s\n",
-                trexio_string_of_error(rc));
-        free(mo_energy);
-        free(data);
-        exit(1);
-    }
-
-    // Read in the two-electron integrals
-
-    // Get number of non-zero integrals
-    int64_t n_integrals; //! Number of non-zero two-electron integrals
-    rc = trexio_read_mo_2e_int_eri_size(trexio_file, &n_integrals);
-    // Check the return code to be sure reading was OK
-    if (rc != TREXIO_SUCCESS) {
-        fprintf(stderr, "TREXIO Error reading number of non-zero two-electron integrals: n%s\n",
-                trexio_string_of_error(rc));
-        free(mo_energy);
-        free(data);
-        exit(1);
-    }
-
-    // Allocate memory for storing the indices
-    int32_t* index = malloc(4 * n_integrals * sizeof(int32_t)); //! Array of indices of the two-electron integrals
-    if (index == NULL) {
-        fprintf(stderr, "Allocation of index array for two-electron integrals failed\n");
-        free(mo_energy);
-        free(data);
-        exit(-1);
-    }
-
-    // Allocate memory for storing the values of the integrals
-    double* value = malloc(n_integrals * sizeof(double)); //! Array of values of the two-electron integrals
-    if (value == NULL) {
-        fprintf(stderr, "Allocation of value array for two-electron integrals failed\n");
-        free(mo_energy);
-        free(data);
-        free(index);
-        exit(-1);
-    }
-
-    // Read in the integrals
-    int64_t buffer_size = n_integrals; //! Buffer size for reading, initially equal to number of two-electron integrals
-    rc = trexio_read_mo_2e_int_eri(trexio_file, 0, &buffer_size, index, value);
-    // Check the return code to be sure reading was OK
-    if (rc != TREXIO_SUCCESS) {
-        fprintf(stderr, "TREXIO Error reading two-electron integrals: n%s\n",
-                trexio_string_of_error(rc));
-        free(mo_energy);
-        free(data);
-        free(index);
-        free(value);
-        exit(1);
-    }
-
-    // Check if buffer size is equal to number of integrals
-    if (buffer_size != n_integrals) {
-        fprintf(stderr, "Not all two-electron integrals were read correctly\n");
-        free(mo_energy);
-        free(data);
-        free(index);
-        free(value);
-        exit(1);
-    }
-
-    // Close the TREXIO file
-    rc = trexio_close(trexio_file);
-    if (rc != TREXIO_SUCCESS) {
-        fprintf(stderr, "TREXIO Error: %s\n", trexio_string_of_error(rc));
-        exit(1);
-    }
-    trexio_file = NULL;
-
-    printf("\nCalculating the Hartree-Fock energy...\n");
-    
-    start_hf = clock(); // Start timing the Hartree-Fock energy calculation
-
-    //Calculate one-electron energy contribution
-    double one_el_energy = one_electron_energy(data, n_up, mo_num); //! One-electron energy contribution
-
-    // Calculate the two-electron energy contribution
-    double two_el_energy = two_electron_energy(index, value, n_up, n_integrals); //! Two-electron energy contribution
-    
-    // Calculate the Hartree-Fock energy
-    double HF_energy = hartree_fock_energy(nuc_repul, one_el_energy, two_el_energy); //! Hartree-Fock energy
-
-    end_hf = clock(); // End timing the Hartree-Fock energy calculation
-    
-    printf("Done!\n");
-
-    printf("\nCalculating the MP2 energy correction...\n");
-    
-    start_mp2 = clock(); // Start timing the MP2 energy correction calculation
-
-    // Calculate MP2 energy
-    double MP2_energy = MP2_energy_correction(index, value, mo_energy, n_up, n_integrals); //! MP2 energy
- 
-    end_mp2 = clock(); // End timing the MP2 energy correction calculation
-
-    printf("Done!\n"); 
-
-    clock_t end_total = clock(); // End timing the entire program
-
-    // Calculate times in seconds
-    double time_total = ((double) (end_total - start_total)) / CLOCKS_PER_SEC;
-    double time_hf = ((double) (end_hf - start_hf)) / CLOCKS_PER_SEC;
-    double time_mp2 = ((double) (end_mp2 - start_mp2)) / CLOCKS_PER_SEC;
-    double time_other = time_total - (time_hf + time_mp2);
-
-    // Print a summary
+/**
+ * @brief Prints the energies, system information and timings of a calculation
+ * @param result Result of the calculation
+ * @param n_threads Number of threads used by the kernels
+ */
+static void print_summary(const calc_result* result, int n_threads) {
     printf("\n################## Energy Summary ##################\n");
-    printf("\nNuclear repulsion energy:            %9.6lf\n", nuc_repul);
-    printf("One-electron energy:                 %9.6lf\n", one_el_energy);
-    printf("Two-electron energy:                 %9.6lf\n", two_el_energy);
-    printf("Hartree-Fock energy:                 %9.6lf\n", HF_energy);
-    printf("MP2 energy correction:               %9.6lf\n", MP2_energy);
-    printf("Total energy (HF + MP2):             %9.6lf\n", HF_energy + MP2_energy);
+    printf("\nNuclear repulsion energy:            %9.6lf\n", result->nuc_repul);
+    printf("One-electron energy:                 %9.6lf\n", result->one_el_energy);
+    printf("Two-electron energy:                 %9.6lf\n", result->two_el_energy);
+    printf("Hartree-Fock energy:                 %9.6lf\n", result->HF_energy);
+    printf("MP2 energy correction:               %9.6lf\n", result->MP2_energy);
+    printf("Total energy (HF + MP2):             %9.6lf\n", result->HF_energy + result->MP2_energy);
     printf("\n################ System Information ################\n");
-    printf("\nNumber of occupied orbitals:         %d\n", n_up);
-    printf("Number of molecular orbitals:        %d\n", mo_num);
-    printf("Number of two-electron integrals:    %ld\n", n_integrals);
+    printf("\nNumber of occupied orbitals:         %d\n", result->n_up);
+    printf("Number of molecular orbitals:        %d\n", result->mo_num);
+    printf("Number of two-electron integrals:    %ld\n", result->n_integrals);
+    printf("Number of threads:                   %d\n", n_threads);
+    if (result->chunk_size > 0) {
+        printf("Integrals per streamed chunk:        %ld\n", result->chunk_size);
+    }
     printf("\n################# Timing Information ################\n");
-    printf("HF calculation time:                 %.6f seconds\n", time_hf);
-    printf("MP2 calculation time:                %.6f seconds\n", time_mp2);
-    printf("I/O and setup time:                  %.6f seconds\n", time_other);
-    printf("Total execution time:                %.6f seconds\n", time_total);
-
-    // Finalize the calculation
-    printf("\nYour calculation is done.\n");
-    printf("Thank you for using the program!\n");
-
-    // Free the allocated arrays
-    free(mo_energy);
-    mo_energy = NULL;
-    free(value);
-    value = NULL;
-    free(index);
-    index = NULL;
-    free(data);
-    data = NULL;
+    printf("HF calculation time:                 %.6f seconds\n", result->time_hf);
+    printf("MP2 calculation time:                %.6f seconds\n", result->time_mp2);
+    printf("I/O and setup time:                  %.6f seconds\n", result->time_setup);
+    printf("Total execution time:                %.6f seconds\n", result->time_total);
+    if (result->chunk_size > 0) {
+        // Reads that completed while the previous chunk was processed were hidden
+        double io_read_time = result->io_read_time;
+        double io_hidden_time = io_read_time > result->io_wait_time ? io_read_time - result->io_wait_time : 0;
+        printf("Integral read time (reader thread):  %.6f seconds\n", io_read_time);
+        printf("Integral read time hidden:           %.6f seconds (%.1f %%)\n", io_hidden_time,
+               io_read_time > 0 ? 100 * io_hidden_time / io_read_time : 0.0);
+    }
+
+    // Breakdown of the total time into the phases of the calculation
+    printf("\nPhase          Time (s)   Read (MB)");
+    if (result->hw_counters) {
+        printf("      Cycles (M)  Cache misses (k)");
+    }
+    printf("\n");
+    for (int p = 0; p < N_PHASES; p++) {
+        printf("%-12s %10.6f %11.3f", phase_name(p), result->phases.time[p], result->phases.bytes[p] / 1e6);
+        if (result->hw_counters) {
+            printf(" %15.3f %17.3f", result->phases.counts[p][COUNTER_CYCLES] / 1e6,
+                   result->phases.counts[p][COUNTER_CACHE_MISSES] / 1e3);
+        }
+        printf("\n");
+    }
+}
 
+/**
+ * @brief Writes the JSON trace of the phases of one or many calculations
+ * @param trace_name Name of the trace file
+ * @param files Processed files
+ * @param results Results, one per file
+ * @param n_files Number of files
+ * @param n_threads Number of threads per calculation
+ * @return 0 on success, 1 if the file cannot be opened
+ */
+static int write_trace(const char* trace_name, char** files, const calc_result* results, int n_files, int n_threads) {
+    FILE* trace = fopen(trace_name, "w");
+    if (trace == NULL) {
+        fprintf(stderr, "Could not open file %s for writing.\n", trace_name);
+        return 1;
+    }
+    int counters = n_files > 0; // Counts are only written if every calculation recorded them
+    for (int f = 0; f < n_files; f++) {
+        counters = counters && results[f].hw_counters;
+    }
+    write_trace_json(trace, files, results, n_files, n_threads, counters);
+    fclose(trace);
     return 0;
 }
 
+/**
+ * @brief The main entry point of the program.
+ *
+ * A single HDF5 file is processed interactively with a full summary. Several files,
+ * a directory or the option -o switch to batch mode, which prints one table of results.
+ *
+ * @return int Returns 0 upon successful execution.
+ */
+int main(int argc, char *argv[]) {
+    calc_options options = {0, 0, 1, 0}; //! Calculation options
+    char** paths = malloc((argc > 1 ? argc : 1) * sizeof(char*)); //! Paths given on the command line
+    int n_paths = 0; //! Number of paths given on the command line
+    char input_path[4096]; //! Buffer for a path provided interactively
+    int n_threads = 0; //! Number of threads for the HF and MP2 kernels, 0 keeps the OpenMP default
+    int n_workers = 1; //! Number of molecules processed concurrently in batch mode
+    const char* output_name = NULL; //! File for the results table in batch mode, NULL for stdout
+    const char* trace_name = NULL; //! File for the JSON trace of the phases, NULL if no trace is written
+    if (paths == NULL) {
+        fprintf(stderr, "Memory allocation failed!\n");
+        return 1;
+    }
+
+    // Check which command line options are provided
+    for (int i = 1; i < argc; i++) { // Loop over command line arguments
+        if (strcmp(argv[i], "-d") == 0) {
+            options.dense_mp2 = 1;
+        }
+        else if (strcmp(argv[i], "-j") == 0) {
+            if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+                n_threads = atoi(argv[++i]);
+            }
+            else {
+                fprintf(stderr, "Option -j requires the specification of a positive number of threads, e.g. -j 4\n");
+                free(paths);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-b") == 0) {
+            if (i + 1 < argc && atoll(argv[i + 1]) > 0) {
+                options.chunk_size = atoll(argv[++i]);
+            }
+            else {
+                fprintf(stderr, "Option -b requires the specification of a positive buffer size, e.g. -b 100000\n");
+                free(paths);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-w") == 0) {
+            if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+                n_workers = atoi(argv[++i]);
+            }
+            else {
+                fprintf(stderr, "Option -w requires the specification of a positive number of workers, e.g. -w 4\n");
+                free(paths);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-o") == 0) {
+            if (i + 1 < argc) {
+                output_name = argv[++i];
+            }
+            else {
+                fprintf(stderr, "Option -o requires the specification of an output file, e.g. -o results.csv\n");
+                free(paths);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-p") == 0) {
+            options.hw_counters = 1;
+        }
+        else if (strcmp(argv[i], "-t") == 0) {
+            if (i + 1 < argc) {
+                trace_name = argv[++i];
+            }
+            else {
+                fprintf(stderr, "Option -t requires the specification of a trace file, e.g. -t trace.json\n");
+                free(paths);
+                return 1;
+            }
+        }
+        else {
+            paths[n_paths++] = argv[i];
+        }
+    }
+
+    // Check if a HDF5 file was specified as argument
+    if (n_paths == 0) {
+        fprintf(stderr, "No HDF5 file containing the data was specified. You can do so by using the program as follows: ./HF_and_MP2 'path/to/hdf5' or by providing the path for your file below:\nPath to HDF5 file: ");
+        if (scanf("%4095s", input_path) != 1) {
+            fprintf(stderr, "No path to a HDF5 file was provided\n");
+            free(paths);
+            return 1;
+        }
+        paths[n_paths++] = input_path;
+    }
+
+    // Several files, a directory or a results file select the batch mode
+    struct stat info;
+    int batch = n_paths > 1 || output_name != NULL ||
+                (stat(paths[0], &info) == 0 && S_ISDIR(info.st_mode)); //! Defines whether batch mode is used
+
+    if (!batch) {
+#ifdef _OPENMP
+        if (n_threads > 0) {
+            omp_set_num_threads(n_threads);
+        }
+        n_threads = omp_get_max_threads();
+#else
+        n_threads = 1;
+#endif
+
+        // Greet the user
+        // Start with an ASCII art of the program name
+        printf(" ___  ___  ________      _____ ______   ________    _______     \n");
+        printf("|\\  \\|\\  \\|\\  _____\\    |\\   _ \\  _   \\|\\   __  \\  /  ___  \\    \n");
+        printf("\\ \\  \\\\\\  \\ \\  \\__/     \\ \\  \\\\\\__\\ \\  \\ \\  \\|\\  \\/__/|_/  /|   \n");
+        printf(" \\ \\   __  \\ \\   __\\     \\ \\  \\\\|__| \\  \\ \\   ____\\__|//  / /   \n");
+        printf("  \\ \\  \\ \\  \\ \\  \\_|      \\ \\  \\    \\ \\  \\ \\  \\___|   /  /_/__  \n");
+        printf("   \\ \\__\\ \\__\\ \\__\\        \\ \\__\\    \\ \\__\\ \\__\\     |\\________\\\n");
+        printf("    \\|__|\\|__|\\|__|         \\|__|     \\|__|\\|__|      \\|_______|\n");
+        printf("\nWelcome to the Hartree-Fock and MP2 energy calculation program.\n");
+
+        calc_workspace work; //! Buffers of the calculation
+        calc_result result; //! Energies, system information and timings
+        init_workspace(&work);
+        int status = run_calculation(paths[0], &options, &work, &result);
+        free_workspace(&work);
+        if (status == 0 && trace_name != NULL) {
+            status = write_trace(trace_name, paths, &result, 1, n_threads);
+        }
+        free(paths);
+        if (status != 0) {
+            exit(1);
+        }
+
+        print_summary(&result, n_threads);
+
+        // Finalize the calculation
+        printf("\nYour calculation is done.\n");
+        printf("Thank you for using the program!\n");
+        return 0;
+    }
+
+    // Batch mode
+    options.verbose = 0;
+    char** files; //! Files to process
+    int n_files = collect_inputs(paths, n_paths, &files); //! Number of files to process
+    free(paths);
+    if (n_files < 0) {
+        fprintf(stderr, "Could not build the list of input files\n");
+        return 1;
+    }
+
+    // Without -j, the available threads are shared among the workers
+#ifdef _OPENMP
+    if (n_threads == 0) {
+        n_threads = omp_get_max_threads() / n_workers;
+    }
+#endif
+    if (n_threads < 1) {
+        n_threads = 1;
+    }
+
+    calc_result* results = calloc(n_files > 0 ? n_files : 1, sizeof(calc_result)); //! One result per file
+    if (results == NULL) {
+        fprintf(stderr, "Memory allocation failed for the results!\n");
+        free_inputs(files, n_files);
+        return 1;
+    }
+
+    double start_batch = wall_time();
+    run_batch(files, n_files, &options, n_workers, n_threads, results);
+    double time_batch = wall_time() - start_batch;
+
+    // Write the results table, as JSON if the file name ends with .json and as CSV otherwise
+    FILE* output = stdout; //! Stream for the results table
+    if (output_name != NULL) {
+        output = fopen(output_name, "w");
+        if (output == NULL) {
+            fprintf(stderr, "Could not open file %s for writing.\n", output_name);
+            free(results);
+            free_inputs(files, n_files);
+            return 1;
+        }
+    }
+    size_t name_length = output_name != NULL ? strlen(output_name) : 0;
+    if (name_length >= 5 && strcmp(output_name + name_length - 5, ".json") == 0) {
+        write_results_json(output, files, results, n_files);
+    }
+    else {
+        write_results_csv(output, files, results, n_files);
+    }
+    if (output != stdout) {
+        fclose(output);
+    }
+    int trace_status = 0; //! Status of writing the trace
+    if (trace_name != NULL) {
+        trace_status = write_trace(trace_name, files, results, n_files, n_threads);
+    }
+
+    int n_failed = 0; //! Number of failed calculations
+    for (int f = 0; f < n_files; f++) {
+        n_failed += results[f].status != 0;
+    }
+    fprintf(stderr, "Processed %d files (%d failed) with %d workers in %.6f seconds\n",
+            n_files, n_failed, n_workers < n_files ? n_workers : n_files, time_batch);
+
+    free(results);
+    free_inputs(files, n_files);
+    return (n_failed > 0 || trace_status != 0) ? 1 : 0;
+}
@@ -0,0 +1,178 @@
+/**
+ * @file reader.c
+ * @brief Contains the double-buffered reader thread for streaming the two-electron integrals.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <trexio.h>
+#include "headers.h"
+
+pthread_mutex_t trexio_lock = PTHREAD_MUTEX_INITIALIZER; //! Serializes all calls into TREXIO and HDF5
+
+/**
+ * @brief Body of the reader thread
+ *
+ * Fills the two buffers alternately with consecutive chunks of integrals. A buffer
+ * is only overwritten once the consumer has released it. An empty chunk marks the
+ * end of the file, a negative count an error.
+ * @param arg Pointer to the eri_reader
+ * @return NULL
+ */
+static void* reader_thread(void* arg) {
+    eri_reader* reader = arg;
+    int64_t offset = 0; // Offset of the next chunk in the file
+
+    for (int k = 0; ; k++) {
+        int b = k % 2; // Buffer to fill
+
+        // Wait until the consumer has released the buffer
+        pthread_mutex_lock(&reader->lock);
+        while (reader->full[b]) {
+            pthread_cond_wait(&reader->cond, &reader->lock);
+        }
+        pthread_mutex_unlock(&reader->lock);
+
+        int64_t count = 0; // Number of integrals read into the buffer
+        if (offset < reader->n_integrals) {
+            count = reader->chunk_size;
+            pthread_mutex_lock(&trexio_lock);
+            double start = wall_time();
+            trexio_exit_code rc = trexio_read_mo_2e_int_eri(reader->file, offset, &count,
+                                                            reader->index[b], reader->value[b]);
+            reader->read_time += wall_time() - start;
+            pthread_mutex_unlock(&trexio_lock);
+            // TREXIO_END signals that the last chunk was read
+            if ((rc != TREXIO_SUCCESS && rc != TREXIO_END) || count <= 0) {
+                reader->rc = (rc != TREXIO_SUCCESS) ? rc : TREXIO_FAILURE;
+                reader->error_offset = offset;
+                count = -1;
+            }
+            else {
+                pack_indices(reader->index[b], count); // Halves the index traffic of the kernels
+                offset += count;
+            }
+        }
+
+        // Hand the buffer over to the consumer
+        pthread_mutex_lock(&reader->lock);
+        reader->count[b] = count;
+        reader->full[b] = 1;
+        pthread_cond_broadcast(&reader->cond);
+        pthread_mutex_unlock(&reader->lock);
+
+        if (count <= 0) {
+            break; // End of file or error
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Allocates the buffers and starts the reader thread
+ *
+ * The buffers of a previous run are reused if they are large enough. The reader
+ * must be zero-initialized before its first use.
+ * @param reader Reader to initialize
+ * @param file TREXIO file handle, only used by the reader thread until eri_reader_finish
+ * @param n_integrals Total number of integrals in the file
+ * @param chunk_size Maximum number of integrals per chunk
+ * @return 0 on success, -1 if allocation or thread creation fails
+ */
+int eri_reader_start(eri_reader* reader, trexio_t* file, int64_t n_integrals, int64_t chunk_size) {
+    if (reader->capacity < chunk_size) {
+        free_eri_reader(reader);
+        for (int b = 0; b < 2; b++) {
+            reader->index[b] = malloc(4 * chunk_size * sizeof(int32_t));
+            reader->value[b] = malloc(chunk_size * sizeof(double));
+        }
+        if (reader->index[0] == NULL || reader->index[1] == NULL ||
+            reader->value[0] == NULL || reader->value[1] == NULL) {
+            free_eri_reader(reader);
+            return -1;
+        }
+        reader->capacity = chunk_size;
+    }
+
+    reader->file = file;
+    reader->n_integrals = n_integrals;
+    reader->chunk_size = chunk_size;
+    reader->rc = TREXIO_SUCCESS;
+    reader->error_offset = 0;
+    reader->current = -1;
+    reader->read_time = 0;
+    reader->wait_time = 0;
+    for (int b = 0; b < 2; b++) {
+        reader->count[b] = 0;
+        reader->full[b] = 0;
+    }
+
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->cond, NULL);
+    if (pthread_create(&reader->thread, NULL, reader_thread, reader) != 0) {
+        pthread_mutex_destroy(&reader->lock);
+        pthread_cond_destroy(&reader->cond);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Releases the current chunk and waits for the next one
+ * @param reader Running reader
+ * @param index Set to the packed indices of the next chunk
+ * @param value Set to the values of the next chunk
+ * @return Number of integrals in the chunk, 0 at the end of the file, -1 on a read error
+ */
+int64_t eri_reader_next(eri_reader* reader, const packed_index** index, const double** value) {
+    pthread_mutex_lock(&reader->lock);
+    int b = 0; // Buffer holding the next chunk
+    if (reader->current >= 0) {
+        reader->full[reader->current] = 0; // The reader may now refill the buffer
+        pthread_cond_broadcast(&reader->cond);
+        b = 1 - reader->current;
+    }
+    double start = wall_time();
+    while (!reader->full[b]) {
+        pthread_cond_wait(&reader->cond, &reader->lock);
+    }
+    reader->wait_time += wall_time() - start;
+    int64_t count = reader->count[b];
+    pthread_mutex_unlock(&reader->lock);
+
+    reader->current = b;
+    *index = (const packed_index*) reader->index[b];
+    *value = reader->value[b];
+    return count;
+}
+
+/**
+ * @brief Waits for the reader thread to finish
+ *
+ * Must only be called after eri_reader_next returned 0 or -1. The buffers are kept
+ * for the next run and released by free_eri_reader.
+ * @param reader Reader to finalize
+ * @return TREXIO_SUCCESS or the error code of the failed read
+ */
+trexio_exit_code eri_reader_finish(eri_reader* reader) {
+    pthread_join(reader->thread, NULL);
+    pthread_mutex_destroy(&reader->lock);
+    pthread_cond_destroy(&reader->cond);
+    return reader->rc;
+}
+
+/**
+ * @brief Frees the buffers of a reader that is not running
+ * @param reader Reader to free
+ */
+void free_eri_reader(eri_reader* reader) {
+    for (int b = 0; b < 2; b++) {
+        free(reader->index[b]);
+        free(reader->value[b]);
+        reader->index[b] = NULL;
+        reader->value[b] = NULL;
+    }
+    reader->capacity = 0;
+}
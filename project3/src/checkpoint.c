@@ -0,0 +1,179 @@
+/**
+ * @file checkpoint.c
+ * @brief Contains the binary checkpoint files for resuming a run.
+ *
+ * A checkpoint holds the state of the run followed by the coordinates, velocities
+ * and accelerations as doubles, with a neighbor list the coordinates of its last
+ * build, the long-range accelerations and the coordinates of the last build of the
+ * short-range neighbor list of the multiple-time-step integrator, the index in
+ * the input of every atom, as the atoms are reordered, and the pair distance
+ * histogram of the radial distribution function sampled so far. It is written to
+ * a temporary file that replaces the previous checkpoint only once it is complete,
+ * so a crash never leaves a broken checkpoint.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "headers.h"
+
+#define CHECKPOINT_MAGIC "MDCHK004" // First 8 bytes of a checkpoint
+
+/**
+ * @brief Writes the vectors of all atoms
+ * @param file File to write to
+ * @param array Vectors of all atoms
+ * @param n_atoms Number of atoms
+ * @return 1 on success, 0 otherwise
+ */
+static int write_vectors(FILE* file, const vec3_array* array, int n_atoms) {
+    return fwrite(array->x, sizeof(double), n_atoms, file) == (size_t) n_atoms &&
+           fwrite(array->y, sizeof(double), n_atoms, file) == (size_t) n_atoms &&
+           fwrite(array->z, sizeof(double), n_atoms, file) == (size_t) n_atoms;
+}
+
+/**
+ * @brief Reads the vectors of all atoms
+ * @param file File to read from
+ * @param array Vectors of all atoms
+ * @param n_atoms Number of atoms
+ * @return 1 on success, 0 otherwise
+ */
+static int read_vectors(FILE* file, vec3_array* array, int n_atoms) {
+    return fread(array->x, sizeof(double), n_atoms, file) == (size_t) n_atoms &&
+           fread(array->y, sizeof(double), n_atoms, file) == (size_t) n_atoms &&
+           fread(array->z, sizeof(double), n_atoms, file) == (size_t) n_atoms;
+}
+
+/**
+ * @brief Flushes the directory of a file to disk, so a rename in it survives a crash
+ * @param filename Name of the file
+ * @return 1 on success, 0 otherwise
+ */
+static int sync_directory(const char* filename) {
+    char directory[4096];
+    const char* slash = strrchr(filename, '/');
+    if (slash == NULL) {
+        snprintf(directory, sizeof(directory), ".");
+    }
+    else {
+        snprintf(directory, sizeof(directory), "%.*s", (int) (slash - filename) + 1, filename);
+    }
+    int descriptor = open(directory, O_RDONLY);
+    if (descriptor < 0) {
+        return 0;
+    }
+    int ok = fsync(descriptor) == 0;
+    return close(descriptor) == 0 && ok;
+}
+
+/**
+ * @brief Atomically writes a checkpoint
+ * @param filename Name of the checkpoint
+ * @param state State of the run
+ * @param n_atoms Number of atoms
+ * @param coords Array of atomic coordinates
+ * @param velocities Array of atomic velocities
+ * @param accelerations Array of atomic accelerations
+ * @param reference Coordinates at the last neighbor list build, NULL without neighbor list
+ * @param slow_accelerations Long-range accelerations of the multiple-time-step integrator, NULL without
+ * @param inner_reference Coordinates at the last build of the short-range neighbor list, NULL without
+ * @param ids Index in the input of every atom
+ * @param histogram Pair distance histogram with state->rdf_bins entries
+ * @return 1 on success, 0 otherwise, the previous checkpoint is kept in that case
+ */
+int write_checkpoint(const char* filename, const checkpoint_state* state, int n_atoms, const vec3_array* coords,
+                     const vec3_array* velocities, const vec3_array* accelerations, const vec3_array* reference,
+                     const vec3_array* slow_accelerations, const vec3_array* inner_reference, const int* ids,
+                     const long* histogram) {
+    char temporary_name[4096]; //! The checkpoint is complete before it gets its final name
+    snprintf(temporary_name, sizeof(temporary_name), "%s.tmp", filename);
+    FILE* file = fopen(temporary_name, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file %s for writing the checkpoint.\n", temporary_name);
+        return 0;
+    }
+
+    int32_t atoms = n_atoms;
+    int ok = fwrite(CHECKPOINT_MAGIC, 8, 1, file) == 1 &&
+             fwrite(&atoms, sizeof(atoms), 1, file) == 1 &&
+             fwrite(state, sizeof(checkpoint_state), 1, file) == 1 &&
+             write_vectors(file, coords, n_atoms) &&
+             write_vectors(file, velocities, n_atoms) &&
+             write_vectors(file, accelerations, n_atoms) &&
+             (state->cutoff <= 0 || write_vectors(file, reference, n_atoms)) &&
+             (state->respa_steps <= 1 || (write_vectors(file, slow_accelerations, n_atoms) &&
+                                          write_vectors(file, inner_reference, n_atoms))) &&
+             fwrite(ids, sizeof(int), n_atoms, file) == (size_t) n_atoms &&
+             fwrite(histogram, sizeof(long), state->rdf_bins, file) == (size_t) state->rdf_bins;
+    ok = fflush(file) == 0 && ok;
+    ok = fsync(fileno(file)) == 0 && ok; // The data must be on disk before the rename
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temporary_name, filename) != 0) {
+        fprintf(stderr, "Could not write the checkpoint %s.\n", filename);
+        remove(temporary_name);
+        return 0;
+    }
+    if (!sync_directory(filename)) { // The checkpoint is complete, only the rename may not be on disk yet
+        fprintf(stderr, "Could not flush the directory of the checkpoint %s.\n", filename);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Reads a checkpoint
+ * @param filename Name of the checkpoint
+ * @param state Set to the state of the run
+ * @param n_atoms Number of atoms of the input file
+ * @param coords Array of atomic coordinates
+ * @param velocities Array of atomic velocities
+ * @param accelerations Array of atomic accelerations
+ * @param reference Set to the coordinates at the last neighbor list build, if the run used a neighbor list
+ * @param slow_accelerations Set to the long-range accelerations, if the run used multiple time steps
+ * @param inner_reference Set to the coordinates at the last build of the short-range neighbor list, if the run used multiple time steps
+ * @param ids Set to the index in the input of every atom
+ * @param histogram Set to the pair distance histogram, RDF_BINS entries
+ * @return 1 on success, 0 otherwise
+ */
+int read_checkpoint(const char* filename, checkpoint_state* state, int n_atoms, vec3_array* coords,
+                    vec3_array* velocities, vec3_array* accelerations, vec3_array* reference,
+                    vec3_array* slow_accelerations, vec3_array* inner_reference, int* ids, long* histogram) {
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open the checkpoint %s.\n", filename);
+        return 0;
+    }
+
+    char magic[8];
+    int32_t atoms;
+    if (fread(magic, 8, 1, file) != 1 || memcmp(magic, CHECKPOINT_MAGIC, 8) != 0 ||
+        fread(&atoms, sizeof(atoms), 1, file) != 1 || fread(state, sizeof(checkpoint_state), 1, file) != 1) {
+        fprintf(stderr, "%s is not a checkpoint of this program.\n", filename);
+        fclose(file);
+        return 0;
+    }
+    if (atoms != n_atoms) {
+        fprintf(stderr, "The checkpoint %s contains %d atoms, the input file %d.\n", filename, atoms, n_atoms);
+        fclose(file);
+        return 0;
+    }
+    int ok = read_vectors(file, coords, n_atoms) &&
+             read_vectors(file, velocities, n_atoms) &&
+             read_vectors(file, accelerations, n_atoms) &&
+             (state->cutoff <= 0 || read_vectors(file, reference, n_atoms)) &&
+             (state->respa_steps <= 1 || (read_vectors(file, slow_accelerations, n_atoms) &&
+                                          read_vectors(file, inner_reference, n_atoms))) &&
+             fread(ids, sizeof(int), n_atoms, file) == (size_t) n_atoms &&
+             state->rdf_bins <= RDF_BINS &&
+             fread(histogram, sizeof(long), state->rdf_bins, file) == (size_t) state->rdf_bins;
+    fclose(file);
+    if (!ok) {
+        fprintf(stderr, "The checkpoint %s is incomplete.\n", filename);
+        return 0;
+    }
+    return 1;
+}
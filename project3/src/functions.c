@@ -5,120 +5,170 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <math.h>
+#include <omp.h>
 #include "headers.h"
 
+#define PHILOX_ROUNDS 10 // Rounds of the Philox4x32 random number generator
+#define PHILOX_M0 0xD2511F53u // Multipliers of the Philox4x32 rounds
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u // Increments of the Philox4x32 key, the golden ratio and sqrt(3) - 1
+#define PHILOX_W1 0xBB67AE85u
+
 /**
- * @brief Allocates a 2D array of doubles
- * @param rows Number of rows in the array
- * @param cols Number of columns in the array
- * @return Pointer to the allocated 2D array
+ * @brief Allocates zero-initialized vectors for all atoms
+ *
+ * The x, y and z components are stored as three contiguous arrays in a single
+ * block, each aligned to VEC3_ALIGNMENT bytes, so the loops over the atoms stream
+ * through memory and can be vectorized.
+ * @param n_atoms Number of atoms
+ * @return Vectors of all atoms
  * @throws Exits with code 1 if memory allocation fails
  */
-double** allocate_2d_array(int rows, int cols) {
-    double** array = (double**)malloc(rows * sizeof(double*));
-    if (array == NULL) {
+vec3_array allocate_vec3_array(int n_atoms) {
+    // Pad every component to a multiple of the alignment
+    size_t stride = ((size_t) (n_atoms > 0 ? n_atoms : 1) * sizeof(double) + VEC3_ALIGNMENT - 1)
+                    / VEC3_ALIGNMENT * VEC3_ALIGNMENT;
+    double* block = (double*)aligned_alloc(VEC3_ALIGNMENT, 3 * stride);
+    if (block == NULL) {
         fprintf(stderr, "Memory allocation failed!\n");
         exit(1);
     }
-    
-    for (int i = 0; i < rows; i++) {
-        array[i] = (double*)malloc(cols * sizeof(double));
-        if (array[i] == NULL) {
-            fprintf(stderr, "Memory allocation failed!\n");
-            for (int j = 0; j < i; j++) { // Free previously allocated memory
-                free(array[j]);
-            }
-            free(array);
-            exit(1);
-        }
-    }
+    memset(block, 0, 3 * stride);
+
+    vec3_array array;
+    array.x = block;
+    array.y = block + stride / sizeof(double);
+    array.z = block + 2 * stride / sizeof(double);
     return array;
 }
 
 /**
- * @brief Frees a 2D array from memory
- * @param array Pointer to the 2D array to be freed
- * @param rows Number of rows in the array
+ * @brief Copies the vectors of all atoms
+ * @param destination Vectors to be overwritten
+ * @param source Vectors to be copied
+ * @param n_atoms Number of atoms
  */
-void free_2d_array(double** array, int rows) {
-    if (array == NULL) return;
-    
-    for (int i = 0; i < rows; i++) {
-        free(array[i]);
-    }
-    free(array);
+void copy_vec3_array(vec3_array* destination, const vec3_array* source, int n_atoms) {
+    memcpy(destination->x, source->x, n_atoms * sizeof(double));
+    memcpy(destination->y, source->y, n_atoms * sizeof(double));
+    memcpy(destination->z, source->z, n_atoms * sizeof(double));
 }
 
 /**
- * @brief Reads the number of atoms from an input file
- * @param filename Name of the input file
- * @return Number of atoms
- * @throws Exits with code 1 if file cannot be opened
+ * @brief Frees the vectors of all atoms
+ * @param array Vectors to be freed
  */
-int read_natoms(const char* filename) {
-    // Open file
-    FILE* file = fopen(filename, "r");
-    if (file == NULL) {
-        fprintf(stderr, "Could not open file %s, please check whether the filename is correct\n", filename);
-        exit(1);
-    }
-    // Read number of atoms from first line of the file
-    int n_atoms;
-    fscanf(file, "%d", &n_atoms);
-    fclose(file);
-    return n_atoms;
+void free_vec3_array(vec3_array* array) {
+    free(array->x); // The y and z components are part of the same block
+    array->x = NULL;
+    array->y = NULL;
+    array->z = NULL;
 }
 
 /**
- * @brief Reads atomic coordinates and masses from an input file
- * @param filename Name of the input file
- * @param coords 2D array to store coordinates
- * @param masses Array to store atomic masses
- * @param n_atoms Number of atoms
- * @throws Exits with code 1 if file cannot be opened
+ * @brief Lennard-Jones parameters of an element known to the engine
  */
-void read_coords_and_masses(const char* filename,
-                            double** coords,
-                            double* masses,
-                            int n_atoms) {
-    // Open file
-    FILE* file = fopen(filename, "r");
-    if (file == NULL) {
-        fprintf(stderr, "Could not open file %s\n", filename);
-        exit(1);
-    }
-    
-    // Skip the first line containing the number of atoms
-    int dummy; // Dummy variable used by read_coords_and_masses for reading the input
-    fscanf(file, "%d", &dummy);
-    
-    // Read coordinates and masses
-    for (int i = 0; i < n_atoms; i++) {
-        fscanf(file, "%lf %lf %lf %lf", &coords[i][0], &coords[i][1], &coords[i][2], &masses[i]);
-    }
-    
-    fclose(file);
-}
+typedef struct {
+    const char* symbol; //! Element symbol
+    double mass; //! Atomic mass
+    double epsilon; //! Epsilon parameter in j/mol
+    double sigma; //! Sigma parameter in nm
+} element_params;
+
+//! Elements known to the engine, the atoms are identified by their mass
+static const element_params elements[] = {
+    {"Ar", ARGON_MASS, ARGON_EPSILON, ARGON_SIGMA},
+    {"Kr", KRYPTON_MASS, KRYPTON_EPSILON, KRYPTON_SIGMA},
+    {"Xe", XENON_MASS, XENON_EPSILON, XENON_SIGMA},
+};
 
 /**
- * @brief Validates that all atoms in the system are argon
- * @param masses Array of atomic masses
- * @param epsilon Pointer to store the epsilon parameter
- * @param sigma Pointer to store the sigma parameter
+ * @brief Identifies the element of every atom and sorts the atoms by type
+ *
+ * The types are numbered in the order of the elements table and only elements
+ * present in the system get a type. The sort is stable, so the atoms of one type
+ * keep the order of the input file.
+ * @param coords Array of atomic coordinates, sorted by type
+ * @param masses Array of atomic masses, sorted by type
  * @param n_atoms Number of atoms
- * @return 1 if all atoms are valid, 0 otherwise
+ * @param field Set to the force field of the types in the system
+ * @param ids Set to the index in the input of every atom
+ * @return 1 if all atoms are known, 0 otherwise
+ * @throws Exits with code 1 if memory allocation fails
  */
-int validate_atoms(double* masses, double* epsilon, double* sigma, int n_atoms) {
+int assign_types(vec3_array* coords, double* masses, int n_atoms, force_field* field, int* ids) {
+    int n_elements = (int) (sizeof(elements) / sizeof(elements[0]));
+    int* element_of = (int*)malloc((n_atoms > 0 ? n_atoms : 1) * sizeof(int));
+    if (element_of == NULL) {
+        fprintf(stderr, "Memory allocation failed for the atom types!\n");
+        exit(1);
+    }
+    int count[MAX_TYPES] = {0}; // Atoms of every element
     for (int i = 0; i < n_atoms; i++) {
-        if (masses[i] != ARGON_MASS) {
+        element_of[i] = -1;
+        for (int e = 0; e < n_elements; e++) {
+            if (fabs(masses[i] - elements[e].mass) < 1e-3) {
+                element_of[i] = e;
+                count[e]++;
+            }
+        }
+        if (element_of[i] < 0) {
             fprintf(stderr, "Error: This MD engine isn't parametrized for some of the atoms in the input file\n");
+            free(element_of);
             return 0;
         }
     }
 
-    *epsilon = ARGON_EPSILON;
-    *sigma = ARGON_SIGMA;
+    // Number the elements present in the system
+    int type_of_element[MAX_TYPES];
+    field->n_types = 0;
+    field->type_first[0] = 0;
+    for (int e = 0; e < n_elements; e++) {
+        type_of_element[e] = -1;
+        if (count[e] > 0) {
+            int t = field->n_types++;
+            type_of_element[e] = t;
+            field->symbols[t] = elements[e].symbol;
+            field->epsilon[t] = elements[e].epsilon;
+            field->sigma[t] = elements[e].sigma;
+            field->type_first[t + 1] = field->type_first[t] + count[e];
+        }
+    }
+
+    // Sort by type, a single type keeps the input untouched
+    if (field->n_types > 1) {
+        vec3_array sorted = allocate_vec3_array(n_atoms);
+        double* sorted_masses = (double*)malloc(n_atoms * sizeof(double));
+        if (sorted_masses == NULL) {
+            fprintf(stderr, "Memory allocation failed for the atom types!\n");
+            exit(1);
+        }
+        int next[MAX_TYPES];
+        for (int t = 0; t < field->n_types; t++) {
+            next[t] = field->type_first[t];
+        }
+        for (int i = 0; i < n_atoms; i++) {
+            int k = next[type_of_element[element_of[i]]]++;
+            sorted.x[k] = coords->x[i];
+            sorted.y[k] = coords->y[i];
+            sorted.z[k] = coords->z[i];
+            sorted_masses[k] = masses[i];
+            ids[k] = i;
+        }
+        copy_vec3_array(coords, &sorted, n_atoms);
+        memcpy(masses, sorted_masses, n_atoms * sizeof(double));
+        free_vec3_array(&sorted);
+        free(sorted_masses);
+    }
+    else {
+        for (int i = 0; i < n_atoms; i++) {
+            ids[i] = i;
+        }
+    }
+    free(element_of);
     return 1;
 }
 
@@ -143,6 +193,7 @@ FILE* open_output(const char* filename) {
  * @param energy_file File pointer for energy output
  * @param extended_file File pointer for extended information
  * @param acceleration_file File pointer for acceleration data
+ * @param symbols Element symbol of every atom
  * @param n_atoms Number of atoms
  * @param step Current simulation step
  * @param kinetic_energy Current kinetic energy
@@ -153,8 +204,8 @@ FILE* open_output(const char* filename) {
  * @param accelerations Array of atomic accelerations
  */
 void print_output(FILE* trajectory_file, FILE* energy_file, FILE* extended_file, FILE* acceleration_file, 
-                 int n_atoms, int step, double kinetic_energy, double potential_energy, double total_energy,
-                 double** coords, double** velocities, double** accelerations) {
+                 const char** symbols, int n_atoms, int step, double kinetic_energy, double potential_energy, double total_energy,
+                 const vec3_array* coords, const vec3_array* velocities, const vec3_array* accelerations) {
     
     // Print comment line with number of atoms, step and energies
     fprintf(trajectory_file, "%d\nStep %d: E(kin) = %10.8f, E(pot) = %10.8f, E(tot) = %10.8f\n",
@@ -166,102 +217,113 @@ void print_output(FILE* trajectory_file, FILE* energy_file, FILE* extended_file,
 
     // Print coordinates, velocities and accelerations
     for (int i = 0; i < n_atoms; i++) {
-        fprintf(trajectory_file, "Ar    %10.6f %10.6f %10.6f\n",
-                coords[i][0], coords[i][1], coords[i][2]);
-        fprintf(extended_file, "Ar     %10.6f %10.6f %10.6f     %10.6f %10.6f %10.6f\n",
-                coords[i][0], coords[i][1], coords[i][2], velocities[i][0], velocities[i][1], velocities[i][2]);
-        fprintf(acceleration_file, "Ar    %10.6f %10.6f %10.6f\n",
-                accelerations[i][0], accelerations[i][1], accelerations[i][2]);
+        fprintf(trajectory_file, "%-6s%10.6f %10.6f %10.6f\n",
+                symbols[i], coords->x[i], coords->y[i], coords->z[i]);
+        fprintf(extended_file, "%-7s%10.6f %10.6f %10.6f     %10.6f %10.6f %10.6f\n",
+                symbols[i], coords->x[i], coords->y[i], coords->z[i], velocities->x[i], velocities->y[i], velocities->z[i]);
+        fprintf(acceleration_file, "%-6s%10.6f %10.6f %10.6f\n",
+                symbols[i], accelerations->x[i], accelerations->y[i], accelerations->z[i]);
     }
 }
 
 /**
- * @brief Initialize random velocities 
- * @param velocities Array of velocities
- * @param masses Array of masses
- * @param temperature Temperature
- * @param n_atoms Number of atoms
+ * @brief Multiplies two 32-bit words into the high and low word of the product
+ * @param a First factor
+ * @param b Second factor
+ * @param high Set to the high word
+ * @return Low word
  */
-void initialize_velocities(double** velocities, double* masses, double temperature, int n_atoms) {
-    // Loop over all atoms
-    for (int i = 0; i < n_atoms; i++) {
-        
-        // Calculate mean velocity for the given temperature
-        double mean_velocity = sqrt(3 * R * temperature/masses[i]); 
-        
-        // Get random angles phi between 0 and 2PI and theta between 0 and PI
-        float phi = ((float) rand() / RAND_MAX) * 2.0f * PI;
-        float theta = ((float) rand() / RAND_MAX) * 1.0f * PI;
-        
-        // Initialize velocity vector in random direction and with mean velocity
-        velocities[i][0] = sinf(theta) * cosf(phi) * mean_velocity;
-        velocities[i][1] = sinf(theta) * sinf(phi) * mean_velocity;
-        velocities[i][2] = cosf(theta) * mean_velocity;
-    }
+static uint32_t multiply_high_low(uint32_t a, uint32_t b, uint32_t* high) {
+    uint64_t product = (uint64_t) a * b;
+    *high = (uint32_t) (product >> 32);
+    return (uint32_t) product;
 }
 
 /**
- * @brief Calculates distances between all pairs of atoms
- * @param coords Array of atomic coordinates
- * @param distances 2D array to store pairwise distances
- * @param n_atoms Number of atoms
+ * @brief Counter-based random number generator Philox4x32-10
+ *
+ * Turns a counter and a key into four random words without any state, so every
+ * atom can draw its own numbers from its index in any order and on any thread.
+ * @param counter Counter, replaced by the four random words
+ * @param key Key, the seed of the run
  */
-void calculate_distances(double** coords, double** distances, int n_atoms) {
-    
-    for (int i = 0; i < n_atoms; i++) {
-        distances[i][i] = 0.0;  // Distance to the atom itself is 0.0
-        for (int j = i + 1; j < n_atoms; j++) {
-            double dx = coords[i][0] - coords[j][0]; // Distance in x 
-            double dy = coords[i][1] - coords[j][1]; // Distance in y
-            double dz = coords[i][2] - coords[j][2]; // Distance in z
-            
-            double r = sqrt(dx*dx + dy*dy + dz*dz);  // Distance in 3D
-            // Pairwise distance matrix is symmetric
-            distances[i][j] = r;
-            distances[j][i] = r;
-        }
+static void philox_4x32(uint32_t counter[4], const uint32_t key[2]) {
+    uint32_t k0 = key[0], k1 = key[1];
+    for (int round = 0; round < PHILOX_ROUNDS; round++) {
+        uint32_t high0, high1;
+        uint32_t low0 = multiply_high_low(PHILOX_M0, counter[0], &high0);
+        uint32_t low1 = multiply_high_low(PHILOX_M1, counter[2], &high1);
+        uint32_t c1 = counter[1], c3 = counter[3];
+        counter[0] = high1 ^ c1 ^ k0;
+        counter[1] = low1;
+        counter[2] = high0 ^ c3 ^ k1;
+        counter[3] = low0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
     }
 }
 
 /**
- * @brief Calculates the Lennard-Jones potential between two atoms
- * @param r Distance between atoms
- * @param epsilon Epsilon parameter for LJ potential
- * @param sigma Sigma parameter for LJ potential
- * @return Value of the Lennard-Jones potential
+ * @brief Converts a random word to a uniform number in (0, 1)
+ * @param word Random word
+ * @return Uniform number, never 0 or 1
  */
-static double lennard_jones_potential(double r,
-                                      double epsilon,
-                                      double sigma) {
-    double sigma_r = sigma / r; 
-    double sigma_r_6 = pow(sigma_r, 6);
-    double sigma_r_12 = sigma_r_6 * sigma_r_6;
-    return 4.0 * epsilon * (sigma_r_12 - sigma_r_6);
+static double uniform_open(uint32_t word) {
+    return (word + 0.5) * (1.0 / 4294967296.0);
 }
 
 /**
- * @brief Calculates total potential energy of the system
- * @param distances 2D array of pairwise distances
+ * @brief Initializes the velocities from the Maxwell-Boltzmann distribution
+ *
+ * Every component is a normal random number with the variance R T / m. The normal
+ * numbers of an atom come from one Philox block keyed by the seed with the index
+ * of the atom in the input as counter and the Box-Muller transform, so the
+ * velocities do not depend on the number of threads or on the order of the atoms.
+ * The momentum of the centre of mass is removed afterwards.
+ * @param velocities Array of velocities
+ * @param masses Array of masses
+ * @param temperature Temperature
  * @param n_atoms Number of atoms
- * @param epsilon Epsilon parameter for LJ potential
- * @param sigma Sigma parameter for LJ potential
- * @return Total potential energy of the system
+ * @param ids Index in the input of every atom
+ * @param seed Seed of the random numbers
  */
-double calculate_potential_energy(double** distances,
-                                  int n_atoms,
-                                  double epsilon,
-                                  double sigma) {
-    double total_potential = 0.0; 
-    
-    // Sum over all unique pairs of i and j where j > i
+void initialize_velocities(vec3_array* velocities, double* masses, double temperature, int n_atoms,
+                           const int* ids, unsigned long seed) {
+    const uint32_t key[2] = {(uint32_t) seed, (uint32_t) ((uint64_t) seed >> 32)};
+    double* restrict vx = velocities->x;
+    double* restrict vy = velocities->y;
+    double* restrict vz = velocities->z;
+
+    #pragma omp parallel for schedule(static)
     for (int i = 0; i < n_atoms; i++) {
-        for (int j = i + 1; j < n_atoms; j++) {
-            double r = distances[i][j];
-            total_potential += lennard_jones_potential(r, epsilon, sigma);
-        }
+        uint32_t block[4] = {(uint32_t) ids[i], 0, 0, 0};
+        philox_4x32(block, key);
+
+        // Box-Muller transform of the four uniform numbers into normal ones, three are used
+        double radius_a = sqrt(-2.0 * log(uniform_open(block[0])));
+        double angle_a = 2.0 * PI * uniform_open(block[1]);
+        double radius_b = sqrt(-2.0 * log(uniform_open(block[2])));
+        double angle_b = 2.0 * PI * uniform_open(block[3]);
+        double sigma = sqrt(R * temperature / masses[i]); // Standard deviation of every component
+        vx[i] = sigma * radius_a * cos(angle_a);
+        vy[i] = sigma * radius_a * sin(angle_a);
+        vz[i] = sigma * radius_b * cos(angle_b);
     }
 
-    return total_potential;
+    // Remove the drift of the centre of mass, the momentum is summed in a fixed order
+    double px = 0.0, py = 0.0, pz = 0.0, total_mass = 0.0;
+    for (int i = 0; i < n_atoms; i++) {
+        px += masses[i] * vx[i];
+        py += masses[i] * vy[i];
+        pz += masses[i] * vz[i];
+        total_mass += masses[i];
+    }
+    double drift_x = px / total_mass, drift_y = py / total_mass, drift_z = pz / total_mass; // Velocity of the centre of mass
+    for (int i = 0; i < n_atoms; i++) {
+        vx[i] -= drift_x;
+        vy[i] -= drift_y;
+        vz[i] -= drift_z;
+    }
 }
 
 /**
@@ -271,15 +333,18 @@ double calculate_potential_energy(double** distances,
  * @param n_atoms Number of atoms
  * @return Total kinetic energy of the system
  */
-double calculate_kinetic_energy(double** velocities,
+double calculate_kinetic_energy(const vec3_array* velocities,
                                 double* masses,
                                 int n_atoms) {
     double total_kinetic = 0.0;
+    const double* vx = velocities->x;
+    const double* vy = velocities->y;
+    const double* vz = velocities->z;
     
     for (int i = 0; i < n_atoms; i++) {
-        double v_squared = velocities[i][0] * velocities[i][0] + 
-                           velocities[i][1] * velocities[i][1] +
-                           velocities[i][2] * velocities[i][2]; 
+        double v_squared = vx[i] * vx[i] + 
+                           vy[i] * vy[i] +
+                           vz[i] * vz[i]; 
         total_kinetic += 0.5 * masses[i] * v_squared;
     }
     
@@ -304,88 +369,880 @@ double calculate_total_energy(double kinetic_energy, double potential_energy) {
  * @warning Prints warning if energy varies by more than 10%
  */
 void check_energy(double previous_energy, double total_energy, int step) {
-    double difference = abs(total_energy - previous_energy); // Difference in total energy between subsequent steps
-    if (difference > 0.10 * abs(previous_energy)) {
+    double difference = fabs(total_energy - previous_energy); // Difference in total energy between subsequent steps
+    if (difference > 0.10 * fabs(previous_energy)) {
         printf("WARNING: The total energy is varying by more than 10 %% in step %5d.\n", step);
     }
 }
 
+/**
+ * @brief Calculates the temperature from the kinetic energy by equipartition
+ * @param kinetic_energy Kinetic energy in kJ/mol
+ * @param n_atoms Number of atoms
+ * @return Temperature in K
+ */
+double calculate_temperature(double kinetic_energy, int n_atoms) {
+    return 2 * kinetic_energy/(3 * n_atoms * R);
+}
+
 /**
  * @brief Velocity-rescaling thermostat
  * @param kinetic_energy Kinetic energy
  * @param temperature Desired temperature
  * @param velocities Velocities
  * @param n_atoms Number of atoms
+ * @return Kinetic energy after the rescaling, without another pass over the velocities
  */
-void thermostat(double kinetic_energy, double temperature, double** velocities, int n_atoms) {
-    double actual_temperature = 2 * kinetic_energy/(n_atoms * R);
+double thermostat(double kinetic_energy, double temperature, vec3_array* velocities, int n_atoms) {
+    double actual_temperature = calculate_temperature(kinetic_energy, n_atoms);
     double factor = sqrt(temperature/actual_temperature);
+    double* restrict vx = velocities->x;
+    double* restrict vy = velocities->y;
+    double* restrict vz = velocities->z;
     for (int i = 0; i < n_atoms; i++) {
-        for (int j = 0; j < 3; j++) {
-            velocities[i][j] = velocities[i][j] * factor;
+        vx[i] = vx[i] * factor;
+        vy[i] = vy[i] * factor;
+        vz[i] = vz[i] * factor;
+    }
+    return kinetic_energy * factor * factor;
+}
+
+/**
+ * @brief Allocates the force buffers of the threads
+ * @param buffers Force buffers to be initialized
+ * @param n_atoms Number of atoms
+ * @param n_threads Number of threads computing the forces
+ * @param n_bins Number of bins of the pair distance histogram, 0 for none
+ * @param bin_width Width of a bin in nm
+ * @param histogram Pair distance histogram with n_bins entries, the samples are added to it
+ * @throws Exits with code 1 if memory allocation fails
+ */
+void init_force_buffers(force_buffers* buffers, int n_atoms, int n_threads, int n_bins, double bin_width, long* histogram) {
+    buffers->n_threads = n_threads;
+    buffers->forces = (vec3_array*)malloc(n_threads * sizeof(vec3_array));
+    buffers->energies = (double*)malloc(n_threads * sizeof(double));
+    buffers->virials = (double*)malloc(n_threads * sizeof(double));
+    buffers->counts = (int*)malloc((n_bins > 0 ? n_threads * n_bins : 1) * sizeof(int));
+    buffers->virial = 0.0;
+    buffers->sample = 0;
+    buffers->n_bins = n_bins;
+    buffers->bin_width = bin_width;
+    buffers->histogram = histogram;
+    if (buffers->forces == NULL || buffers->energies == NULL || buffers->virials == NULL || buffers->counts == NULL) {
+        fprintf(stderr, "Memory allocation failed for the force buffers!\n");
+        exit(1);
+    }
+    for (int t = 1; t < n_threads; t++) { // Thread 0 accumulates directly into the accelerations
+        buffers->forces[t] = allocate_vec3_array(n_atoms);
+    }
+}
+
+/**
+ * @brief Frees the force buffers of the threads
+ * @param buffers Force buffers to be freed
+ */
+void free_force_buffers(force_buffers* buffers) {
+    for (int t = 1; t < buffers->n_threads; t++) {
+        free_vec3_array(&buffers->forces[t]);
+    }
+    free(buffers->forces);
+    free(buffers->energies);
+    free(buffers->virials);
+    free(buffers->counts);
+}
+
+/**
+ * @brief Sets up the parameters of the Lennard-Jones pair kernels for all pairs of types
+ *
+ * Unlike types are combined with the Lorentz-Berthelot rules, the arithmetic mean
+ * of sigma and the geometric mean of epsilon. For the multiple-time-step integrator,
+ * the short-range part is the potential times S(r^2), which falls smoothly from 1
+ * to 0 over the last RESPA_SWITCH_WIDTH before the inner cutoff, and the long-range
+ * part is the potential times 1 - S(r^2), so both parts add up to the full potential.
+ * @param field Force field
+ * @param cutoff Cutoff radius, INFINITY for no cutoff
+ * @param box Simulation box
+ * @param part FORCE_FULL, FORCE_SHORT or FORCE_LONG
+ * @param inner_cutoff Cutoff of the short-range part
+ * @param table Set to the parameters of the types a and b at a * n_types + b
+ */
+static void make_lj_params(const force_field* field, double cutoff, const simulation_box* box, int part,
+                           double inner_cutoff, lj_params* table) {
+    double switch_start = inner_cutoff - RESPA_SWITCH_WIDTH;
+    double switch_start_2 = switch_start > 0.0 ? switch_start * switch_start : 0.0;
+    double inv_switch_width_2 = part != FORCE_FULL ? 1.0 / (inner_cutoff * inner_cutoff - switch_start_2) : 0.0;
+    double weight_switch = part == FORCE_SHORT ? 1.0 : -1.0;
+    for (int a = 0; a < field->n_types; a++) {
+        for (int b = 0; b < field->n_types; b++) {
+            lj_params* params = &table[a * field->n_types + b];
+            double epsilon = sqrt(field->epsilon[a] * field->epsilon[b]);
+            double sigma = 0.5 * (field->sigma[a] + field->sigma[b]);
+            double sigma_6 = sigma * sigma * sigma * sigma * sigma * sigma;
+            params->c6 = 4.0 * epsilon * sigma_6;
+            params->c12 = params->c6 * sigma_6;
+            params->force_c6 = 6.0 * params->c6;
+            params->force_c12 = 12.0 * params->c12;
+            params->cutoff_2 = cutoff * cutoff;
+            params->periodic = box->periodic;
+            for (int k = 0; k < 3; k++) { // Zero lengths leave the distances unchanged
+                params->box[k] = box->periodic ? box->length[k] : 0.0;
+                params->inv_box[k] = box->periodic ? 1.0 / box->length[k] : 0.0;
+            }
+            params->switched = part != FORCE_FULL;
+            params->switch_start_2 = switch_start_2;
+            params->inv_switch_width_2 = inv_switch_width_2;
+            params->weight_constant = part == FORCE_LONG ? 1.0 : 0.0;
+            params->weight_switch = weight_switch;
+            params->switch_slope = 12.0 * weight_switch * inv_switch_width_2;
         }
     }
 }
 
 /**
- * @brief Helper function for acceleration calculation
- * @param r Distance between atoms
- * @param epsilon Epsilon parameter for LJ potential
- * @param sigma Sigma parameter for LJ potential
- * @return U value
+ * @brief Zeroes the forces before the pair kernels accumulate them
+ * @param forces Array of forces
+ * @param n_atoms Number of atoms
  */
-static double calculate_U(double r,
-                          double epsilon,
-                          double sigma) {
-    double sigma_r = sigma / r;
-    double sigma_r_6 = pow(sigma_r, 6); 
-    double sigma_r_12 = sigma_r_6 * sigma_r_6; 
-    return 24.0 * (epsilon / r) * (sigma_r_6 - 2.0 * sigma_r_12); 
+static void clear_forces(vec3_array* forces, int n_atoms) {
+    for (int i = 0; i < n_atoms; i++) {
+        forces->x[i] = 0.0;
+        forces->y[i] = 0.0;
+        forces->z[i] = 0.0;
+    }
+}
+
+/**
+ * @brief Adds the distances of a row of pairs to a histogram
+ *
+ * Called right after the pair kernel evaluated the same row, so the coordinates of
+ * the partners are still in the cache.
+ * @param i Index of the atom
+ * @param partners Indices of the partners, NULL for the consecutive atoms first, first + 1, ...
+ * @param first First partner if partners is NULL
+ * @param count Number of partners
+ * @param params Lennard-Jones parameters of the row, for the minimum-image convention
+ * @param coords Array of atomic coordinates
+ * @param inv_bin_width Inverse width of a bin
+ * @param n_bins Number of bins, farther pairs are not counted
+ * @param counts Histogram
+ */
+static void bin_pair_distances(int i, const int* partners, int first, int count, const lj_params* params,
+                               const vec3_array* coords, double inv_bin_width, int n_bins, int* counts) {
+    const double* x = coords->x;
+    const double* y = coords->y;
+    const double* z = coords->z;
+    for (int n = 0; n < count; n++) {
+        int j = partners != NULL ? partners[n] : first + n;
+        double dx = x[i] - x[j];
+        double dy = y[i] - y[j];
+        double dz = z[i] - z[j];
+        if (params->periodic) {
+            dx -= params->box[0] * nearbyint(dx * params->inv_box[0]);
+            dy -= params->box[1] * nearbyint(dy * params->inv_box[1]);
+            dz -= params->box[2] * nearbyint(dz * params->inv_box[2]);
+        }
+        double bin = sqrt(dx*dx + dy*dy + dz*dz) * inv_bin_width;
+        if (bin < n_bins) { // Also false for the distances of an exploded system, which are not a number
+            counts[(int) bin]++;
+        }
+    }
 }
 
 /**
- * @brief Calculates acceleration vectors for all atoms
+ * @brief Accumulates the pair forces in parallel and turns them into accelerations
+ *
+ * Every thread evaluates a share of the rows i and adds both the force on i and the
+ * opposite force on j to its own buffer, so Newton's third law is used without
+ * atomics. The buffers are summed afterwards in a fixed order, so the results only
+ * depend on the number of threads. Every row is split into one segment per type
+ * of j, so each kernel call uses a single set of parameters. The virial is summed
+ * with the energy, and if buffers->sample is set, the pair distances of every row
+ * are binned while the row is in the cache and added to buffers->histogram.
  * @param coords Array of atomic coordinates
  * @param masses Array of atomic masses
  * @param n_atoms Number of atoms
- * @param epsilon Epsilon parameter for LJ potential
- * @param sigma Sigma parameter for LJ potential
- * @param distances 2D array of pairwise distances
+ * @param field Force field
+ * @param table Parameters of the pair kernels for all pairs of types
+ * @param list Neighbor list, NULL for all pairs
+ * @param buffers Force buffers of the threads, set to the virial of the pairs
  * @param accelerations Array to store calculated accelerations
+ * @return Total potential energy of the system
  */
-void calculate_accelerations(double** coords,
-                             double* masses,
-                             int n_atoms, 
-                             double epsilon,
-                             double sigma,
-                             double** distances, 
-                             double** accelerations) {
+static double accumulate_forces(const vec3_array* coords,
+                                double* masses,
+                                int n_atoms,
+                                const force_field* field,
+                                const lj_params* table,
+                                const neighbor_list* list,
+                                force_buffers* buffers,
+                                vec3_array* accelerations) {
+
+    pair_row_kernel pair_row = get_pair_kernel(NULL);
+    int n_threads = 1; //! Number of threads that actually ran
+    int n_types = field->n_types;
+    const int* type_first = field->type_first;
+    int n_bins = buffers->sample ? buffers->n_bins : 0; //! Number of bins of the histogram of this calculation
+    double inv_bin_width = 1.0 / buffers->bin_width;
 
-    for (int i = 0; i < n_atoms; i++) { // Initialize accelerations to zero
-        accelerations[i][0] = 0.0;
-        accelerations[i][1] = 0.0;
-        accelerations[i][2] = 0.0;
+    #pragma omp parallel num_threads(buffers->n_threads)
+    {
+        int t = omp_get_thread_num();
+        int team = omp_get_num_threads();
+        vec3_array* forces = t == 0 ? accelerations : &buffers->forces[t];
+        clear_forces(forces, n_atoms);
+        int* counts = buffers->counts + t * n_bins;
+        for (int k = 0; k < n_bins; k++) {
+            counts[k] = 0;
+        }
+
+        double energy = 0.0;
+        double virial = 0.0;
+        if (list == NULL) {
+            #pragma omp for schedule(static, 1) // Cyclic rows balance the triangle of pairs
+            for (int i = 0; i < n_atoms; i++) {
+                int a = 0; // Type of atom i
+                while (i >= type_first[a + 1]) a++;
+                for (int b = a; b < n_types; b++) {
+                    int first = i + 1 > type_first[b] ? i + 1 : type_first[b];
+                    energy += pair_row(i, NULL, first, type_first[b + 1] - first,
+                                       &table[a * n_types + b], coords, forces, &virial);
+                    if (n_bins > 0) {
+                        bin_pair_distances(i, NULL, first, type_first[b + 1] - first,
+                                           &table[a * n_types + b], coords, inv_bin_width, n_bins, counts);
+                    }
+                }
+            }
+        }
+        else {
+            #pragma omp for schedule(static, 16)
+            for (int i = 0; i < n_atoms; i++) {
+                int a = 0; // Type of atom i
+                while (i >= type_first[a + 1]) a++;
+                const int* start = list->start + i * n_types; // One segment per type of j
+                for (int b = 0; b < n_types; b++) {
+                    energy += pair_row(i, list->neighbors + start[b], 0, start[b + 1] - start[b],
+                                       &table[a * n_types + b], coords, forces, &virial);
+                    if (n_bins > 0) {
+                        bin_pair_distances(i, list->neighbors + start[b], 0, start[b + 1] - start[b],
+                                           &table[a * n_types + b], coords, inv_bin_width, n_bins, counts);
+                    }
+                }
+            }
+        }
+        buffers->energies[t] = energy;
+        buffers->virials[t] = virial;
+
+        // Add the histograms of all threads to the samples
+        if (n_bins > 0) {
+            #pragma omp for schedule(static)
+            for (int k = 0; k < n_bins; k++) {
+                long count = 0;
+                for (int u = 0; u < team; u++) {
+                    count += buffers->counts[u * n_bins + k];
+                }
+                buffers->histogram[k] += count;
+            }
+        }
+
+        // Sum the buffers of all threads and divide by the masses
+        #pragma omp for schedule(static)
+        for (int i = 0; i < n_atoms; i++) {
+            double fx = accelerations->x[i];
+            double fy = accelerations->y[i];
+            double fz = accelerations->z[i];
+            for (int u = 1; u < team; u++) {
+                fx += buffers->forces[u].x[i];
+                fy += buffers->forces[u].y[i];
+                fz += buffers->forces[u].z[i];
+            }
+            double inv_mass = 1.0 / masses[i];
+            accelerations->x[i] = fx * inv_mass;
+            accelerations->y[i] = fy * inv_mass;
+            accelerations->z[i] = fz * inv_mass;
+        }
+
+        if (t == 0) {
+            n_threads = team;
+        }
+    }
+
+    double total_potential = 0.0;
+    buffers->virial = 0.0;
+    for (int t = 0; t < n_threads; t++) {
+        total_potential += buffers->energies[t];
+        buffers->virial += buffers->virials[t];
     }
+    return total_potential;
+}
+
+/**
+ * @brief Calculates acceleration vectors for all atoms and the potential energy
+ *
+ * Every pair is visited once, its force is applied to both atoms and its potential
+ * energy is added in the same pass, so no distance matrix is needed. The pairs are
+ * evaluated by the kernel chosen with select_pair_kernel.
+ * @param coords Array of atomic coordinates
+ * @param masses Array of atomic masses
+ * @param n_atoms Number of atoms
+ * @param field Force field
+ * @param box Simulation box
+ * @param buffers Force buffers of the threads, set to the virial of the pairs
+ * @param accelerations Array to store calculated accelerations
+ * @return Total potential energy of the system
+ */
+double calculate_accelerations(const vec3_array* coords,
+                               double* masses,
+                               int n_atoms, 
+                               const force_field* field,
+                               const simulation_box* box,
+                               force_buffers* buffers,
+                               vec3_array* accelerations) {
+
+    lj_params table[MAX_TYPES * MAX_TYPES];
+    make_lj_params(field, INFINITY, box, FORCE_FULL, 0.0, table);
 
-    calculate_distances(coords, distances, n_atoms); // Update the 2D array of distances    
+    // Sum over all unique pairs of i and j where j > i
+    return accumulate_forces(coords, masses, n_atoms, field, table, NULL, buffers, accelerations);
+}
+
+/**
+ * @brief Applies the minimum-image convention to a distance along one edge of the box
+ * @param d Distance
+ * @param length Edge length of the box, 0 for open boundaries
+ * @return Shortest periodic image of the distance
+ */
+static double minimum_image(double d, double length) {
+    return length > 0.0 ? d - length * nearbyint(d / length) : d;
+}
 
+/**
+ * @brief Wraps the coordinates of all atoms into the periodic box
+ * @param coords Array of atomic coordinates
+ * @param box Simulation box
+ * @param n_atoms Number of atoms
+ */
+void wrap_positions(vec3_array* coords, const simulation_box* box, int n_atoms) {
+    if (!box->periodic) {
+        return;
+    }
+    double* component[3] = {coords->x, coords->y, coords->z};
+    for (int k = 0; k < 3; k++) {
+        double length = box->length[k];
+        double* restrict values = component[k];
+        for (int i = 0; i < n_atoms; i++) {
+            values[i] -= length * floor(values[i] / length);
+        }
+    }
+}
+
+/**
+ * @brief Key of an atom on the Morton curve and its current index
+ */
+typedef struct {
+    uint64_t key; //! Interleaved bits of the cell coordinates
+    int index; //! Current index of the atom
+} morton_entry;
+
+/**
+ * @brief Spreads the lower 21 bits of a cell coordinate to every third bit
+ * @param v Cell coordinate
+ * @return Bits of v at the positions 0, 3, 6, ...
+ */
+static uint64_t spread_bits(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffULL;
+    v = (v | v << 16) & 0x1f0000ff0000ffULL;
+    v = (v | v << 8) & 0x100f00f00f00f00fULL;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2) & 0x1249249249249249ULL;
+    return v;
+}
+
+/**
+ * @brief Orders Morton entries by key, equal keys by index
+ * @param a First entry
+ * @param b Second entry
+ * @return Negative, zero or positive as for qsort
+ */
+static int compare_morton(const void* a, const void* b) {
+    const morton_entry* p = a;
+    const morton_entry* q = b;
+    if (p->key != q->key) return p->key < q->key ? -1 : 1;
+    return (p->index > q->index) - (p->index < q->index);
+}
+
+/**
+ * @brief Moves the vectors of all atoms into a new order
+ * @param array Vectors of all atoms
+ * @param order New position k holds the atom order[k].index
+ * @param scratch Temporary vectors of the same length
+ * @param n_atoms Number of atoms
+ */
+static void permute_vec3(vec3_array* array, const morton_entry* order, vec3_array* scratch, int n_atoms) {
+    for (int k = 0; k < n_atoms; k++) {
+        scratch->x[k] = array->x[order[k].index];
+        scratch->y[k] = array->y[order[k].index];
+        scratch->z[k] = array->z[order[k].index];
+    }
+    copy_vec3_array(array, scratch, n_atoms);
+}
+
+/**
+ * @brief Sorts the atoms along a Morton curve, so atoms close in space are close in memory
+ *
+ * The box, or the bounding box of the atoms without periodic boundaries, is divided
+ * into 2^21 cells along every edge and the atoms of every type are sorted by the
+ * interleaved bits of their cells. The atoms stay grouped by type and ids follows
+ * them, so the output keeps the order of the input.
+ * @param vectors Per-atom vectors to be reordered, the first are the coordinates
+ * @param n_vectors Number of per-atom vectors
+ * @param masses Array of atomic masses
+ * @param ids Index in the input of every atom
+ * @param n_atoms Number of atoms
+ * @param field Force field with the ranges of the atom types
+ * @param box Simulation box
+ * @throws Exits with code 1 if memory allocation fails
+ */
+void reorder_atoms(vec3_array** vectors, int n_vectors, double* masses, int* ids, int n_atoms,
+                   const force_field* field, const simulation_box* box) {
+    const double* component[3] = {vectors[0]->x, vectors[0]->y, vectors[0]->z};
+    double lower[3], scale[3]; // Cells per nm along every edge
+    for (int k = 0; k < 3; k++) {
+        double upper;
+        if (box->periodic) {
+            lower[k] = 0.0;
+            upper = box->length[k];
+        }
+        else {
+            lower[k] = upper = component[k][0];
+            for (int i = 1; i < n_atoms; i++) {
+                if (component[k][i] < lower[k]) lower[k] = component[k][i];
+                if (component[k][i] > upper) upper = component[k][i];
+            }
+        }
+        scale[k] = upper > lower[k] ? 2097151.0 / (upper - lower[k]) : 0.0;
+    }
+
+    morton_entry* order = (morton_entry*)malloc(n_atoms * sizeof(morton_entry));
+    double* scratch_masses = (double*)malloc(n_atoms * sizeof(double));
+    int* scratch_ids = (int*)malloc(n_atoms * sizeof(int));
+    if (order == NULL || scratch_masses == NULL || scratch_ids == NULL) {
+        fprintf(stderr, "Memory allocation failed for reordering the atoms!\n");
+        exit(1);
+    }
+    for (int i = 0; i < n_atoms; i++) {
+        uint64_t key = 0;
+        for (int k = 0; k < 3; k++) {
+            double cell = (component[k][i] - lower[k]) * scale[k];
+            if (cell < 0.0) cell = 0.0;
+            if (cell > 2097151.0) cell = 2097151.0;
+            key |= spread_bits((uint64_t) cell) << k;
+        }
+        order[i].key = key;
+        order[i].index = i;
+    }
+    for (int t = 0; t < field->n_types; t++) { // The types keep their ranges
+        qsort(order + field->type_first[t], field->type_first[t + 1] - field->type_first[t],
+              sizeof(morton_entry), compare_morton);
+    }
+
+    vec3_array scratch = allocate_vec3_array(n_atoms);
+    for (int v = 0; v < n_vectors; v++) {
+        permute_vec3(vectors[v], order, &scratch, n_atoms);
+    }
+    for (int k = 0; k < n_atoms; k++) {
+        scratch_masses[k] = masses[order[k].index];
+        scratch_ids[k] = ids[order[k].index];
+    }
+    memcpy(masses, scratch_masses, n_atoms * sizeof(double));
+    memcpy(ids, scratch_ids, n_atoms * sizeof(int));
+
+    free_vec3_array(&scratch);
+    free(order);
+    free(scratch_masses);
+    free(scratch_ids);
+}
+
+/**
+ * @brief Initializes an empty neighbor list
+ * @param list Neighbor list to initialize
+ * @param n_atoms Number of atoms
+ * @param cutoff Cutoff radius of the Lennard-Jones interaction
+ * @param skin Skin added to the cutoff when the list is built
+ * @param box Simulation box
+ * @param field Force field with the ranges of the atom types
+ * @throws Exits with code 1 if memory allocation fails
+ */
+void init_neighbor_list(neighbor_list* list, int n_atoms, double cutoff, double skin, const simulation_box* box,
+                        const force_field* field) {
+    list->cutoff = cutoff;
+    list->skin = skin;
+    list->box = *box;
+    list->n_types = field->n_types;
+    for (int t = 0; t <= field->n_types; t++) {
+        list->type_first[t] = field->type_first[t];
+    }
+    list->start = (int*)malloc(((size_t) n_atoms * list->n_types + 1) * sizeof(int));
+    list->cell_next = (int*)malloc((n_atoms > 0 ? n_atoms : 1) * sizeof(int));
+    list->cell_of = (int*)malloc((n_atoms > 0 ? n_atoms : 1) * sizeof(int));
+    list->capacity = 16 * (n_atoms > 0 ? n_atoms : 1);
+    list->neighbors = (int*)malloc(list->capacity * sizeof(int));
+    if (list->start == NULL || list->cell_next == NULL || list->cell_of == NULL || list->neighbors == NULL) {
+        fprintf(stderr, "Memory allocation failed for the neighbor list!\n");
+        exit(1);
+    }
+    list->reference = allocate_vec3_array(n_atoms);
+    list->cell_head = NULL;
+    list->n_cells_allocated = 0;
+    list->n_builds = 0;
+    list->spread = 0.0;
+    list->parent = NULL;
+}
+
+/**
+ * @brief Frees the memory held by a neighbor list
+ * @param list Neighbor list
+ */
+void free_neighbor_list(neighbor_list* list) {
+    free(list->start);
+    free(list->neighbors);
+    free(list->cell_head);
+    free(list->cell_next);
+    free(list->cell_of);
+    free_vec3_array(&list->reference);
+}
+
+/**
+ * @brief Measures the spread of a new neighbor list and remembers the positions of the build
+ * @param list Neighbor list that was just filled
+ * @param coords Array of atomic coordinates
+ * @param n_atoms Number of atoms
+ */
+static void finish_neighbor_list(neighbor_list* list, const vec3_array* coords, int n_atoms) {
+    int n_types = list->n_types;
+    int n_entries = list->start[n_atoms * n_types];
+
+    // Mean distance of the partners in memory, which grows as the atoms diffuse
+    long long index_distance = 0;
+    for (int i = 0; i < n_atoms; i++) {
+        for (int e = list->start[i * n_types]; e < list->start[(i + 1) * n_types]; e++) {
+            index_distance += list->neighbors[e] - i;
+        }
+    }
+    list->spread = n_entries > 0 ? (double) index_distance / n_entries : 0.0;
+
+    // Remember the positions for the displacement check
+    for (int i = 0; i < n_atoms; i++) {
+        list->reference.x[i] = coords->x[i];
+        list->reference.y[i] = coords->y[i];
+        list->reference.z[i] = coords->z[i];
+    }
+    list->n_builds++;
+}
+
+/**
+ * @brief Sorts the partners of every atom and type by index
+ *
+ * A list pruned from its parent then does not depend on the order of the parent,
+ * so it is the same as one built with linked cells.
+ * @param list Neighbor list
+ * @param n_atoms Number of atoms
+ */
+static void sort_neighbor_rows(neighbor_list* list, int n_atoms) {
+    for (int row = 0; row < n_atoms * list->n_types; row++) {
+        int* partners = list->neighbors + list->start[row];
+        int count = list->start[row + 1] - list->start[row];
+        for (int a = 1; a < count; a++) { // Insertion sort, the rows are short
+            int j = partners[a];
+            int b = a - 1;
+            for (; b >= 0 && partners[b] > j; b--) {
+                partners[b + 1] = partners[b];
+            }
+            partners[b + 1] = j;
+        }
+    }
+}
+
+/**
+ * @brief Builds the neighbor list with linked cells
+ *
+ * The bounding box of the atoms is divided into cells of at least cutoff + skin,
+ * so all neighbors of an atom are found in its own and the 26 adjacent cells. The
+ * number of cells is limited by the number of atoms, so a sparse cluster with
+ * atoms flying apart does not allocate a huge grid. In a periodic box, the cells
+ * tile the box, the adjacent cells wrap around its faces and the distances follow
+ * the minimum-image convention.
+ * @param list Neighbor list to fill
+ * @param coords Array of atomic coordinates
+ * @param n_atoms Number of atoms
+ * @throws Exits with code 1 if memory allocation fails
+ */
+static void build_neighbor_list(neighbor_list* list, const vec3_array* coords, int n_atoms) {
+    double range = list->cutoff + list->skin; // Radius of the list
+    double range_2 = range * range;
+
+    const double* component[3] = {coords->x, coords->y, coords->z}; // Coordinates along every direction
+
+    const simulation_box* box = &list->box;
+    double length[3] = {0.0, 0.0, 0.0}; // Periodic edge lengths, 0 for open boundaries
+
+    // Bounding box of the atoms, or the periodic box
+    double lower[3] = {0.0, 0.0, 0.0};
+    double upper[3] = {0.0, 0.0, 0.0};
+    if (box->periodic) {
+        for (int k = 0; k < 3; k++) {
+            length[k] = box->length[k];
+            upper[k] = box->length[k];
+        }
+    }
+    else {
+        for (int i = 0; i < n_atoms; i++) {
+            for (int k = 0; k < 3; k++) {
+                if (i == 0 || component[k][i] < lower[k]) lower[k] = component[k][i];
+                if (i == 0 || component[k][i] > upper[k]) upper[k] = component[k][i];
+            }
+        }
+    }
+
+    // Cells at least as large as the range of the list
+    int n_cells[3]; // Number of cells in every direction
+    double cell_size[3]; // Size of the cells in every direction
+    long total_cells = 1;
+    for (int k = 0; k < 3; k++) {
+        double extent = upper[k] - lower[k];
+        n_cells[k] = (int) (extent / range);
+        if (n_cells[k] < 1) n_cells[k] = 1;
+        if (n_cells[k] > n_atoms) n_cells[k] = n_atoms > 0 ? n_atoms : 1;
+        total_cells *= n_cells[k];
+    }
+    while (total_cells > 8L * n_atoms + 27) { // Coarsen the grid of sparse systems
+        total_cells = 1;
+        for (int k = 0; k < 3; k++) {
+            n_cells[k] = (n_cells[k] + 1) / 2;
+            total_cells *= n_cells[k];
+        }
+    }
+    int reach[3]; // Adjacent cells visited on either side
+    for (int k = 0; k < 3; k++) {
+        if (box->periodic && n_cells[k] < 3) { // Wrapped neighbors would be visited twice
+            total_cells = total_cells / n_cells[k];
+            n_cells[k] = 1;
+        }
+        reach[k] = box->periodic && n_cells[k] == 1 ? 0 : 1;
+        cell_size[k] = (upper[k] - lower[k]) / n_cells[k];
+        if (cell_size[k] <= 0.0) cell_size[k] = range;
+    }
+
+    if (total_cells > list->n_cells_allocated) {
+        free(list->cell_head);
+        list->cell_head = (int*)malloc(total_cells * sizeof(int));
+        if (list->cell_head == NULL) {
+            fprintf(stderr, "Memory allocation failed for the cell list!\n");
+            exit(1);
+        }
+        list->n_cells_allocated = (int) total_cells;
+    }
+
+    // Sort the atoms into the cells
+    int* cell_of = list->cell_of;
+    for (long c = 0; c < total_cells; c++) {
+        list->cell_head[c] = -1;
+    }
+    for (int i = n_atoms - 1; i >= 0; i--) { // Reverse order keeps the atoms of a cell in ascending order
+        int cell[3];
+        for (int k = 0; k < 3; k++) {
+            cell[k] = (int) ((component[k][i] - lower[k]) / cell_size[k]);
+            if (cell[k] >= n_cells[k]) cell[k] = n_cells[k] - 1;
+            if (cell[k] < 0) cell[k] = 0;
+        }
+        int c = (cell[2] * n_cells[1] + cell[1]) * n_cells[0] + cell[0];
+        cell_of[i] = c;
+        list->cell_next[i] = list->cell_head[c];
+        list->cell_head[c] = i;
+    }
+
+    // Collect the neighbors j > i of every atom in its own and the adjacent cells,
+    // one pass over the cells per type of j, so the row is grouped by type
+    int n_types = list->n_types;
+    int n_entries = 0;
     for (int i = 0; i < n_atoms; i++) {
-        for (int j = 0; j < n_atoms; j++) {
-            if (i != j) {  // To avoid self-interaction
-                double r = distances[i][j];
-                double U = calculate_U(r, epsilon, sigma);
-                
-                double dx = coords[i][0] - coords[j][0]; // Distance in x
-                double dy = coords[i][1] - coords[j][1]; // Distance in y
-                double dz = coords[i][2] - coords[j][2]; // Distance in z
-                
-                // Calculate accelerations
-                accelerations[i][0] += - (1 / masses[i]) * U * (dx / r);
-                accelerations[i][1] += - (1 / masses[i]) * U * (dy / r);
-                accelerations[i][2] += - (1 / masses[i]) * U * (dz / r);
+        int c = cell_of[i];
+        int cx = c % n_cells[0];
+        int cy = (c / n_cells[0]) % n_cells[1];
+        int cz = c / (n_cells[0] * n_cells[1]);
+        for (int t = 0; t < n_types; t++) {
+            int type_begin = list->type_first[t] > i ? list->type_first[t] : i + 1;
+            int type_end = list->type_first[t + 1];
+            list->start[i * n_types + t] = n_entries;
+            for (int dz = -reach[2]; dz <= reach[2]; dz++) {
+                for (int dy = -reach[1]; dy <= reach[1]; dy++) {
+                    for (int dx = -reach[0]; dx <= reach[0]; dx++) {
+                        int x = cx + dx, y = cy + dy, z = cz + dz;
+                        if (box->periodic) { // Wrap around the faces of the box
+                            x = (x + n_cells[0]) % n_cells[0];
+                            y = (y + n_cells[1]) % n_cells[1];
+                            z = (z + n_cells[2]) % n_cells[2];
+                        }
+                        else if (x < 0 || x >= n_cells[0] || y < 0 || y >= n_cells[1] || z < 0 || z >= n_cells[2]) {
+                            continue;
+                        }
+                        for (int j = list->cell_head[(z * n_cells[1] + y) * n_cells[0] + x]; j >= 0; j = list->cell_next[j]) {
+                            if (j < type_begin || j >= type_end) continue; // Every pair is stored once
+                            double rx = minimum_image(coords->x[i] - coords->x[j], length[0]);
+                            double ry = minimum_image(coords->y[i] - coords->y[j], length[1]);
+                            double rz = minimum_image(coords->z[i] - coords->z[j], length[2]);
+                            if (rx*rx + ry*ry + rz*rz >= range_2) continue;
+                            if (n_entries == list->capacity) {
+                                list->capacity *= 2;
+                                list->neighbors = (int*)realloc(list->neighbors, list->capacity * sizeof(int));
+                                if (list->neighbors == NULL) {
+                                    fprintf(stderr, "Memory allocation failed for the neighbor list!\n");
+                                    exit(1);
+                                }
+                            }
+                            list->neighbors[n_entries++] = j;
+                        }
+                    }
+                }
             }
         }
     }
+    list->start[n_atoms * n_types] = n_entries;
+    if (list->parent != NULL) {
+        sort_neighbor_rows(list, n_atoms);
+    }
+    finish_neighbor_list(list, coords, n_atoms);
+}
+
+/**
+ * @brief Builds the neighbor list from the pairs of its parent list
+ *
+ * The parent list holds all pairs within its cutoff, which is at least the range
+ * of this list, so no cells are needed.
+ * @param list Neighbor list to fill
+ * @param coords Array of atomic coordinates
+ * @param n_atoms Number of atoms
+ * @throws Exits with code 1 if memory allocation fails
+ */
+static void prune_neighbor_list(neighbor_list* list, const vec3_array* coords, int n_atoms) {
+    const neighbor_list* parent = list->parent;
+    double range = list->cutoff + list->skin; // Radius of the list
+    double range_2 = range * range;
+    double length[3] = {0.0, 0.0, 0.0}; // Periodic edge lengths, 0 for open boundaries
+    for (int k = 0; k < 3 && list->box.periodic; k++) {
+        length[k] = list->box.length[k];
+    }
+
+    int n_types = list->n_types;
+    int parent_entries = parent->start[n_atoms * n_types];
+    if (parent_entries > list->capacity) { // The list never holds more pairs than its parent
+        list->capacity = parent_entries;
+        list->neighbors = (int*)realloc(list->neighbors, list->capacity * sizeof(int));
+        if (list->neighbors == NULL) {
+            fprintf(stderr, "Memory allocation failed for the neighbor list!\n");
+            exit(1);
+        }
+    }
+
+    int n_entries = 0;
+    for (int i = 0; i < n_atoms; i++) {
+        for (int t = 0; t < n_types; t++) {
+            list->start[i * n_types + t] = n_entries;
+            for (int e = parent->start[i * n_types + t]; e < parent->start[i * n_types + t + 1]; e++) {
+                int j = parent->neighbors[e];
+                double rx = minimum_image(coords->x[i] - coords->x[j], length[0]);
+                double ry = minimum_image(coords->y[i] - coords->y[j], length[1]);
+                double rz = minimum_image(coords->z[i] - coords->z[j], length[2]);
+                if (rx*rx + ry*ry + rz*rz < range_2) {
+                    list->neighbors[n_entries++] = j;
+                }
+            }
+        }
+    }
+    list->start[n_atoms * n_types] = n_entries;
+    sort_neighbor_rows(list, n_atoms);
+    finish_neighbor_list(list, coords, n_atoms);
+}
+
+/**
+ * @brief Rebuilds the neighbor list of a checkpoint from the positions of its last build
+ *
+ * The list is identical to the one of the interrupted run, so the pairs are
+ * summed in the same order. A list with a parent is built with linked cells as
+ * well, which gives the same pairs in the same order as pruning.
+ * @param list Initialized neighbor list
+ * @param reference Coordinates at the last build before the checkpoint
+ * @param n_builds Number of builds before the checkpoint
+ * @param n_atoms Number of atoms
+ */
+void restore_neighbor_list(neighbor_list* list, const vec3_array* reference, int n_builds, int n_atoms) {
+    build_neighbor_list(list, reference, n_atoms);
+    list->n_builds = n_builds;
+}
+
+/**
+ * @brief Rebuilds the neighbor list if an atom moved by more than half the skin
+ * @param list Neighbor list
+ * @param coords Array of atomic coordinates
+ * @param n_atoms Number of atoms
+ * @return 1 if the list was rebuilt, 0 otherwise
+ */
+int update_neighbor_list(neighbor_list* list, const vec3_array* coords, int n_atoms) {
+    int rebuild = list->n_builds == 0;
+    double limit_2 = 0.25 * list->skin * list->skin; // Square of half the skin
+    double length[3] = {0.0, 0.0, 0.0}; // Wrapping does not count as a displacement
+    if (list->box.periodic) {
+        for (int k = 0; k < 3; k++) {
+            length[k] = list->box.length[k];
+        }
+    }
+    for (int i = 0; i < n_atoms && !rebuild; i++) {
+        double dx = minimum_image(coords->x[i] - list->reference.x[i], length[0]);
+        double dy = minimum_image(coords->y[i] - list->reference.y[i], length[1]);
+        double dz = minimum_image(coords->z[i] - list->reference.z[i], length[2]);
+        rebuild = dx*dx + dy*dy + dz*dz > limit_2;
+    }
+    if (rebuild && list->parent != NULL) {
+        prune_neighbor_list(list, coords, n_atoms);
+    }
+    else if (rebuild) {
+        build_neighbor_list(list, coords, n_atoms);
+    }
+    return rebuild;
+}
+
+/**
+ * @brief Calculates acceleration vectors and the potential energy from a neighbor list
+ *
+ * Pairs farther apart than the cutoff do not interact. The potential is truncated
+ * at the cutoff without shift, so a cutoff larger than the system reproduces
+ * calculate_accelerations.
+ * @param coords Array of atomic coordinates
+ * @param masses Array of atomic masses
+ * @param n_atoms Number of atoms
+ * @param field Force field
+ * @param list Neighbor list valid for the coordinates
+ * @param box Simulation box
+ * @param part FORCE_FULL, or FORCE_SHORT or FORCE_LONG for one part of the multiple-time-step integrator
+ * @param inner_cutoff Cutoff of the short-range part, ignored for FORCE_FULL
+ * @param buffers Force buffers of the threads, set to the virial of the pairs
+ * @param accelerations Array to store calculated accelerations
+ * @return Total potential energy of the system, or of the part
+ */
+double calculate_accelerations_neighbor(const vec3_array* coords,
+                                        double* masses,
+                                        int n_atoms,
+                                        const force_field* field,
+                                        const neighbor_list* list,
+                                        const simulation_box* box,
+                                        int part,
+                                        double inner_cutoff,
+                                        force_buffers* buffers,
+                                        vec3_array* accelerations) {
+
+    lj_params table[MAX_TYPES * MAX_TYPES];
+    make_lj_params(field, list->cutoff, box, part, inner_cutoff, table);
+    return accumulate_forces(coords, masses, n_atoms, field, table, list, buffers, accelerations);
 }
 
 /**
@@ -396,17 +1253,26 @@ void calculate_accelerations(double** coords,
  * @param dt Time step
  * @param n_atoms Number of atoms
  */
-void update_positions(double** coords,
-                      double** velocities,
-                      double** accelerations,
+void update_positions(vec3_array* coords,
+                      const vec3_array* velocities,
+                      const vec3_array* accelerations,
                       double dt,
                       int n_atoms) {
     double dt_2 = 0.5 * dt * dt; // Square of dt * 0.5
+    double* restrict x = coords->x;
+    double* restrict y = coords->y;
+    double* restrict z = coords->z;
+    const double* restrict vx = velocities->x;
+    const double* restrict vy = velocities->y;
+    const double* restrict vz = velocities->z;
+    const double* restrict ax = accelerations->x;
+    const double* restrict ay = accelerations->y;
+    const double* restrict az = accelerations->z;
     for (int i = 0; i < n_atoms; i++) {
         // Calculate new positions
-        coords[i][0] += velocities[i][0] * dt + accelerations[i][0] * dt_2;
-        coords[i][1] += velocities[i][1] * dt + accelerations[i][1] * dt_2;
-        coords[i][2] += velocities[i][2] * dt + accelerations[i][2] * dt_2;
+        x[i] += vx[i] * dt + ax[i] * dt_2;
+        y[i] += vy[i] * dt + ay[i] * dt_2;
+        z[i] += vz[i] * dt + az[i] * dt_2;
     }
 }
 
@@ -417,14 +1283,20 @@ void update_positions(double** coords,
  * @param dt Time step
  * @param n_atoms Number of atoms
  */
-void update_velocities(double** velocities,
-                       double** accelerations,
+void update_velocities(vec3_array* velocities,
+                       const vec3_array* accelerations,
                        double dt,
                        int n_atoms) {
+    double* restrict vx = velocities->x;
+    double* restrict vy = velocities->y;
+    double* restrict vz = velocities->z;
+    const double* restrict ax = accelerations->x;
+    const double* restrict ay = accelerations->y;
+    const double* restrict az = accelerations->z;
     for (int i = 0; i < n_atoms; i++) {
         // Calculate new velocities
-        velocities[i][0] += 0.5 * accelerations[i][0] * dt;
-        velocities[i][1] += 0.5 * accelerations[i][1] * dt;
-        velocities[i][2] += 0.5 * accelerations[i][2] * dt;
+        vx[i] += 0.5 * ax[i] * dt;
+        vy[i] += 0.5 * ay[i] * dt;
+        vz[i] += 0.5 * az[i] * dt;
     }
 }
@@ -6,23 +6,250 @@
 #ifndef FUNCTIONS_H
 #define FUNCTIONS_H
 
-double** allocate_2d_array(int rows, int cols);
-void free_2d_array(double** array, int rows);
-int read_natoms(const char* filename);
-void read_coords_and_masses(const char* filename, double** coords, double* masses, int n_atoms);
-int validate_atoms(double* masses, double* epsilon, double* sigma, int n_atoms);
-void initialize_velocities(double** velocities, double* masses, double temperature, int n_atoms);
-void calculate_distances(double** coords, double** distances, int n_atoms);
-double calculate_potential_energy(double** distances, int n_atoms, double epsilon, double sigma);
-double calculate_kinetic_energy(double** velocities, double* masses, int n_atoms);
+#include <stdio.h>
+#include <pthread.h>
+
+#define VEC3_ALIGNMENT 64 // Alignment of the per-atom arrays in bytes, one cache line
+#define OUTPUT_XYZ 0 // Trajectory as XYZ text files
+#define OUTPUT_BINARY 1 // Trajectory as binary float32 frames
+#define MAX_TYPES 4 // Number of atom types known to the force field
+#define FORCE_FULL 0 // Complete Lennard-Jones interaction
+#define FORCE_SHORT 1 // Short-range part of the multiple-time-step integrator, switched off towards the inner cutoff
+#define FORCE_LONG 2 // Long-range remainder of the multiple-time-step integrator
+#define RESPA_SWITCH_WIDTH 0.1 // Width of the region in nm where the short-range part is switched off
+#define OUTPUT_FILES 6 // Output files: energies, trajectory.xyz, trajectory_velocity.xyz, acceleration, trajectory.trj, observables
+#define RDF_BINS 200 // Number of bins of the radial distribution function
+
+/**
+ * @brief Vectors of all atoms as separate x, y and z arrays
+ *
+ * The three arrays are parts of one aligned block allocated by allocate_vec3_array.
+ */
+typedef struct {
+    double* x; //! x components of all atoms
+    double* y; //! y components of all atoms
+    double* z; //! z components of all atoms
+} vec3_array;
+
+/**
+ * @brief Orthorhombic simulation box
+ */
+typedef struct {
+    int periodic; //! 1 for periodic boundaries, 0 for an isolated cluster
+    double length[3]; //! Edge lengths of the box in nm
+} simulation_box;
+
+/**
+ * @brief Lennard-Jones force field of the atom types in the system
+ *
+ * The atoms are sorted by type, so the atoms of type t are type_first[t], ...,
+ * type_first[t + 1] - 1.
+ */
+typedef struct {
+    int n_types; //! Number of atom types in the system
+    const char* symbols[MAX_TYPES]; //! Element symbols of the types
+    double epsilon[MAX_TYPES]; //! Epsilon parameter of every type in j/mol
+    double sigma[MAX_TYPES]; //! Sigma parameter of every type in nm
+    int type_first[MAX_TYPES + 1]; //! First atom of every type
+} force_field;
+
+/**
+ * @brief Verlet neighbor list built with linked cells
+ *
+ * Stores for every atom i the atoms j > i closer than cutoff + skin, grouped by
+ * the type of j. The list stays valid until an atom moved by more than half the
+ * skin since the last build.
+ */
+typedef struct neighbor_list {
+    double cutoff; //! Cutoff radius of the Lennard-Jones interaction in nm
+    double skin; //! Skin added to the cutoff when the list is built in nm
+    simulation_box box; //! Simulation box
+    int n_types; //! Number of atom types
+    int type_first[MAX_TYPES + 1]; //! First atom of every type
+    int* start; //! First entry of the neighbors of type t of atom i at i * n_types + t, n_atoms * n_types + 1 entries
+    int* neighbors; //! Neighbors j > i of all atoms
+    int capacity; //! Allocated length of neighbors
+    vec3_array reference; //! Coordinates at the last build
+    int* cell_head; //! First atom of every cell, -1 if empty
+    int* cell_next; //! Next atom in the same cell, -1 at the end
+    int* cell_of; //! Cell of every atom
+    int n_cells_allocated; //! Allocated length of cell_head
+    int n_builds; //! Number of builds so far
+    double spread; //! Mean index distance j - i of the pairs at the last build
+    const struct neighbor_list* parent; //! Longer list valid at every build, whose pairs are pruned, NULL to use linked cells
+} neighbor_list;
+
+/**
+ * @brief Private force accumulation buffers of the threads
+ *
+ * Thread 0 accumulates directly into the accelerations, the other threads into
+ * their own buffer, which are summed after all pairs have been evaluated.
+ */
+typedef struct {
+    int n_threads; //! Number of threads computing the forces
+    vec3_array* forces; //! Forces accumulated by every thread, entry 0 is unused
+    double* energies; //! Potential energy accumulated by every thread
+    double* virials; //! Virial accumulated by every thread
+    double virial; //! Virial, the sum of r_ij . f_ij over all pairs, of the last force calculation
+    int sample; //! 1 if the next force calculation adds its pair distances to the histogram
+    int n_bins; //! Number of bins of the pair distance histogram, 0 for none
+    double bin_width; //! Width of a bin of the histogram in nm
+    int* counts; //! Pair distances of the current sample binned by every thread, n_bins entries each
+    long* histogram; //! Pair distances binned over all samples
+} force_buffers;
+
+/**
+ * @brief Parameters of the Lennard-Jones pair kernels for one pair of atom types
+ *
+ * The potential is c12 / r^12 - c6 / r^6.
+ */
+typedef struct {
+    double c6; //! 4 epsilon sigma^6
+    double c12; //! 4 epsilon sigma^12
+    double force_c6; //! 6 c6
+    double force_c12; //! 12 c12
+    int switched; //! 1 if the potential is weighted with weight_constant + weight_switch S(r^2)
+    double switch_start_2; //! Square of the radius where the switching function S starts to fall from 1
+    double inv_switch_width_2; //! Inverse width of the switching region in r^2
+    double weight_constant; //! Constant part of the weight
+    double weight_switch; //! Factor of the switching function in the weight
+    double switch_slope; //! 12 weight_switch inv_switch_width_2, for the derivative of the weight
+    double cutoff_2; //! Square of the cutoff radius, infinite without cutoff
+    int periodic; //! 1 if the minimum-image convention applies
+    double box[3]; //! Edge lengths of the periodic box, 0 for open boundaries
+    double inv_box[3]; //! Inverse edge lengths, 0 for open boundaries
+} lj_params;
+
+/**
+ * @brief Pair kernel evaluating atom i against a row of partners
+ *
+ * Adds the forces to the forces array and the virial of the row to virial, and returns
+ * the potential energy of the row. The partners are the indices in partners, or first,
+ * first + 1, ... if partners is NULL.
+ */
+typedef double (*pair_row_kernel)(int i, const int* partners, int first, int count, const lj_params* params,
+                                  const vec3_array* coords, vec3_array* forces, double* virial);
+
+/**
+ * @brief Progress of the output files, recorded at a checkpoint
+ */
+typedef struct {
+    long n_frames; //! Number of frames written
+    long sizes[OUTPUT_FILES]; //! Sizes of the output files in bytes, -1 for files not in use
+} output_position;
+
+/**
+ * @brief Copy of one frame waiting to be written
+ */
+typedef struct {
+    int step; //! Simulation step
+    double kinetic_energy; //! Kinetic energy
+    double potential_energy; //! Potential energy
+    double total_energy; //! Total energy
+    vec3_array coords; //! Atomic coordinates
+    vec3_array velocities; //! Atomic velocities
+    vec3_array accelerations; //! Atomic accelerations
+} frame_snapshot;
+
+/**
+ * @brief Output files of the simulation and the writer thread filling them
+ *
+ * The integrator queues snapshots in a ring, which the writer thread drains in order.
+ */
+typedef struct {
+    int format; //! OUTPUT_XYZ or OUTPUT_BINARY
+    int stride; //! Number of steps between two frames
+    int n_atoms; //! Number of atoms
+    double dt; //! Time step
+    long n_frames; //! Number of frames written so far
+    long frame_size; //! Size of one binary frame in bytes
+    char* frame; //! Buffer assembling one binary frame
+    FILE* energy_file; //! File where the energies are written
+    FILE* trajectory_file; //! XYZ trajectory
+    FILE* extended_file; //! XYZ trajectory with velocities
+    FILE* acceleration_file; //! Accelerations in XYZ format
+    FILE* binary_file; //! Binary trajectory
+    const char** symbols; //! Element symbol of every atom in the order of the input
+    FILE* observables_file; //! Observables sampled in situ, written by the integrator, NULL if not sampled
+    int analysis_stride; //! Number of steps between two samples of the observables
+    double volume; //! Volume of the periodic box for the pressure, 0 for a cluster
+    frame_snapshot* ring; //! Snapshots queued for the writer thread
+    int n_slots; //! Number of snapshots the ring can hold
+    int first_queued; //! Slot of the oldest queued snapshot
+    int n_queued; //! Number of queued snapshots
+    int closing; //! Set when no further snapshots follow
+    double write_time; //! Time the writer thread spent writing
+    double wait_time; //! Time the integrator waited for free slots
+    pthread_t thread; //! Writer thread
+    pthread_mutex_t lock; //! Protects first_queued, n_queued and closing
+    pthread_cond_t cond; //! Signals changes of the ring
+} output_writer;
+
+/**
+ * @brief State of a run besides the atomic vectors, stored in a checkpoint
+ */
+typedef struct {
+    long step; //! Next step to be run
+    double dt; //! Time step
+    int thermo; //! 1 if the thermostat is used
+    double temperature; //! Temperature of the thermostat
+    double total_energy; //! Total energy of the last step, compared with the next one
+    simulation_box box; //! Simulation box
+    double cutoff; //! Cutoff radius of the neighbor-list force engine, 0 for all pairs
+    double skin; //! Skin of the neighbor list
+    int n_builds; //! Number of neighbor list builds so far
+    int respa_steps; //! Inner steps per step of the multiple-time-step integrator, 1 for velocity Verlet
+    double inner_cutoff; //! Cutoff of the short-range forces
+    int n_inner_builds; //! Number of builds of the short-range neighbor list so far
+    double reorder_factor; //! Growth of the spread that triggers a reordering of the atoms, 0 for none
+    double reorder_spread; //! Spread of the neighbor list after the last reordering of the atoms
+    int n_reorders; //! Number of reorderings so far
+    int n_threads; //! Number of threads computing the forces
+    char kernel[16]; //! Variant of the pair kernel
+    int format; //! Format of the trajectory
+    int stride; //! Number of steps between two written frames
+    int analysis_stride; //! Number of steps between two samples of the observables, 0 for none
+    int rdf_bins; //! Number of bins of the pair distance histogram, 0 for none
+    output_position output; //! Progress of the output files
+} checkpoint_state;
+
+vec3_array allocate_vec3_array(int n_atoms);
+void free_vec3_array(vec3_array* array);
+void copy_vec3_array(vec3_array* destination, const vec3_array* source, int n_atoms);
+int read_input(const char* filename, vec3_array* coords, double** masses);
+int generate_fcc_lattice(double box_length, double density, vec3_array* coords, double** masses);
+int assign_types(vec3_array* coords, double* masses, int n_atoms, force_field* field, int* ids);
+void reorder_atoms(vec3_array** vectors, int n_vectors, double* masses, int* ids, int n_atoms, const force_field* field, const simulation_box* box);
+void initialize_velocities(vec3_array* velocities, double* masses, double temperature, int n_atoms, const int* ids, unsigned long seed);
+double calculate_kinetic_energy(const vec3_array* velocities, double* masses, int n_atoms);
 double calculate_total_energy(double kinetic_energy, double potential_energy);
-void thermostat(double kinetic_energy, double temperature, double** velocities, int n_atoms);
+double calculate_temperature(double kinetic_energy, int n_atoms);
+double thermostat(double kinetic_energy, double temperature, vec3_array* velocities, int n_atoms);
 void check_energy(double previous_energy, double total_energy, int step);
-void calculate_accelerations(double** coords, double* masses, int n_atoms, double epsilon, double sigma, double** distances, double** accelerations);
-void update_positions(double** coords, double** velocities, double** accelerations, double dt, int n_atoms);
-void update_velocities(double** velocities, double** accelerations, double dt, int n_atoms);
+const char* select_pair_kernel(const char* requested);
+pair_row_kernel get_pair_kernel(const char** name);
+void init_force_buffers(force_buffers* buffers, int n_atoms, int n_threads, int n_bins, double bin_width, long* histogram);
+void free_force_buffers(force_buffers* buffers);
+double calculate_accelerations(const vec3_array* coords, double* masses, int n_atoms, const force_field* field, const simulation_box* box, force_buffers* buffers, vec3_array* accelerations);
+void wrap_positions(vec3_array* coords, const simulation_box* box, int n_atoms);
+void init_neighbor_list(neighbor_list* list, int n_atoms, double cutoff, double skin, const simulation_box* box, const force_field* field);
+void free_neighbor_list(neighbor_list* list);
+void restore_neighbor_list(neighbor_list* list, const vec3_array* reference, int n_builds, int n_atoms);
+int update_neighbor_list(neighbor_list* list, const vec3_array* coords, int n_atoms);
+double calculate_accelerations_neighbor(const vec3_array* coords, double* masses, int n_atoms, const force_field* field, const neighbor_list* list, const simulation_box* box, int part, double inner_cutoff, force_buffers* buffers, vec3_array* accelerations);
+void update_positions(vec3_array* coords, const vec3_array* velocities, const vec3_array* accelerations, double dt, int n_atoms);
+void update_velocities(vec3_array* velocities, const vec3_array* accelerations, double dt, int n_atoms);
 FILE* open_output(const char* filename);
-void print_output(FILE* trajectory_file, FILE* energy_file, FILE* extended_file, FILE* acceleration_file, int n_atoms, int step, double kinetic_energy, double potential_energy, double total_energy, double** coords, double** velocities, double** accelerations); 
+int write_checkpoint(const char* filename, const checkpoint_state* state, int n_atoms, const vec3_array* coords, const vec3_array* velocities, const vec3_array* accelerations, const vec3_array* reference, const vec3_array* slow_accelerations, const vec3_array* inner_reference, const int* ids, const long* histogram);
+int read_checkpoint(const char* filename, checkpoint_state* state, int n_atoms, vec3_array* coords, vec3_array* velocities, vec3_array* accelerations, vec3_array* reference, vec3_array* slow_accelerations, vec3_array* inner_reference, int* ids, long* histogram);
+void open_output_writer(output_writer* writer, int format, int stride, int n_slots, int n_atoms, double dt, const char** symbols, const output_position* resume);
+void sync_output_writer(output_writer* writer, output_position* position);
+void write_frame(output_writer* writer, int step, double kinetic_energy, double potential_energy, double total_energy, const vec3_array* coords, const vec3_array* velocities, const vec3_array* accelerations, const int* ids);
+void close_output_writer(output_writer* writer);
+void open_observables(output_writer* writer, int analysis_stride, double volume, const output_position* resume);
+void write_observables(output_writer* writer, int step, double kinetic_energy, double potential_energy, double total_energy, double virial);
+void write_rdf(const char* filename, const long* histogram, int n_bins, double bin_width, long n_samples, int n_atoms, double volume);
+void print_output(FILE* trajectory_file, FILE* energy_file, FILE* extended_file, FILE* acceleration_file, const char** symbols, int n_atoms, int step, double kinetic_energy, double potential_energy, double total_energy, const vec3_array* coords, const vec3_array* velocities, const vec3_array* accelerations);
 #endif
 
 // Constants
@@ -32,7 +259,13 @@ void print_output(FILE* trajectory_file, FILE* energy_file, FILE* extended_file,
 #define ARGON_MASS 39.948
 #define ARGON_EPSILON 0.0661 // j/mol
 #define ARGON_SIGMA 0.3345 // nm
+#define KRYPTON_MASS 83.798
+#define KRYPTON_EPSILON 0.0944 // j/mol, scaled from ARGON_EPSILON with epsilon/k_B = 171 K against 119.8 K
+#define KRYPTON_SIGMA 0.360 // nm
+#define XENON_MASS 131.293
+#define XENON_EPSILON 0.1219 // j/mol, scaled from ARGON_EPSILON with epsilon/k_B = 221 K against 119.8 K
+#define XENON_SIGMA 0.410 // nm
 #define PI 3.14159265358979323846
-#define R 8.31446261815324 // Ideal gas constant in J/K/mol
+#define R 0.00831446261815324 // Ideal gas constant in kJ/K/mol, the unit of the energies with masses in g/mol, nm and ps
 
 #endif
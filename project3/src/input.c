@@ -0,0 +1,248 @@
+/**
+ * @file input.c
+ * @brief Contains the readers of the initial configuration and the FCC lattice generator.
+ *
+ * The input file is mapped into memory and parsed in a single pass. Numbers with at
+ * most 19 significant digits and small exponents are converted exactly with one
+ * division by a power of ten, all other numbers are handed to strtod, so the values
+ * are identical to those of the C library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "headers.h"
+
+//! Powers of ten that are exact in double precision
+static const double powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/**
+ * @brief Position of the parser in the mapped input file
+ */
+typedef struct {
+    const char* position; //! Next character
+    const char* end; //! End of the file
+    int line; //! Current line for error messages
+} input_cursor;
+
+/**
+ * @brief Skips white space and counts the lines
+ * @param cursor Parser position
+ */
+static void skip_space(input_cursor* cursor) {
+    while (cursor->position < cursor->end &&
+           (*cursor->position == ' ' || *cursor->position == '\t' ||
+            *cursor->position == '\n' || *cursor->position == '\r')) {
+        if (*cursor->position == '\n') {
+            cursor->line++;
+        }
+        cursor->position++;
+    }
+}
+
+/**
+ * @brief Parses a floating-point number
+ * @param cursor Parser position, moved behind the number
+ * @param value Set to the number
+ * @return 1 on success, 0 if no number starts at the position
+ */
+static int parse_double(input_cursor* cursor, double* value) {
+    skip_space(cursor);
+    const char* p = cursor->position;
+    const char* start = p;
+    const char* end = cursor->end;
+
+    int negative = 0;
+    if (p < end && (*p == '+' || *p == '-')) {
+        negative = *p == '-';
+        p++;
+    }
+
+    uint64_t mantissa = 0; // Significant digits as an integer
+    int n_digits = 0; // Number of significant digits in the mantissa
+    int scale = 0; // Decimal exponent of the mantissa
+    int any_digit = 0;
+    int exact = 1; // Whether the fast path gives the correctly rounded value
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        any_digit = 1;
+        if (n_digits < 19) {
+            mantissa = 10 * mantissa + (uint64_t) (*p - '0');
+            n_digits += mantissa > 0;
+        }
+        else {
+            scale++;
+            exact = 0;
+        }
+    }
+    if (p < end && *p == '.') {
+        p++;
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            any_digit = 1;
+            if (n_digits < 19) {
+                mantissa = 10 * mantissa + (uint64_t) (*p - '0');
+                n_digits += mantissa > 0;
+                scale--;
+            }
+            else {
+                exact = 0;
+            }
+        }
+    }
+    if (!any_digit) {
+        return 0;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char* q = p + 1;
+        int exponent_negative = 0;
+        if (q < end && (*q == '+' || *q == '-')) {
+            exponent_negative = *q == '-';
+            q++;
+        }
+        if (q < end && *q >= '0' && *q <= '9') {
+            int exponent = 0;
+            for (; q < end && *q >= '0' && *q <= '9'; q++) {
+                if (exponent < 100000) {
+                    exponent = 10 * exponent + (*q - '0');
+                }
+            }
+            scale += exponent_negative ? -exponent : exponent;
+            p = q;
+        }
+    }
+    if (p < end && !(*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        return 0; // The number is followed by garbage
+    }
+
+    if (exact && mantissa < ((uint64_t) 1 << 53) && scale >= -22 && scale <= 22) {
+        // Both operands are exact, so a single operation rounds correctly
+        double result = (double) mantissa;
+        result = scale < 0 ? result / powers_of_ten[-scale] : result * powers_of_ten[scale];
+        *value = negative ? -result : result;
+    }
+    else {
+        char token[128]; // strtod needs a terminated copy, the mapping is not terminated
+        size_t length = (size_t) (p - start);
+        if (length >= sizeof(token)) {
+            return 0;
+        }
+        memcpy(token, start, length);
+        token[length] = '\0';
+        *value = strtod(token, NULL);
+    }
+    cursor->position = p;
+    return 1;
+}
+
+/**
+ * @brief Reads the atomic coordinates and masses from an input file
+ *
+ * The first number of the file is the number of atoms, followed by one line with
+ * the coordinates x, y, z and the mass of every atom.
+ * @param filename Name of the input file
+ * @param coords Set to the vectors of the coordinates
+ * @param masses Set to the array of atomic masses
+ * @return Number of atoms
+ * @throws Exits with code 1 if the file cannot be read, is malformed or memory allocation fails
+ */
+int read_input(const char* filename, vec3_array* coords, double** masses) {
+    int descriptor = open(filename, O_RDONLY);
+    if (descriptor < 0) {
+        fprintf(stderr, "Could not open file %s, please check whether the filename is correct\n", filename);
+        exit(1);
+    }
+    struct stat status;
+    if (fstat(descriptor, &status) != 0 || status.st_size == 0) {
+        fprintf(stderr, "Input file %s is empty\n", filename);
+        exit(1);
+    }
+    const char* data = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    close(descriptor);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Could not map file %s into memory\n", filename);
+        exit(1);
+    }
+    madvise((void*) data, status.st_size, MADV_SEQUENTIAL);
+    input_cursor cursor = {data, data + status.st_size, 1};
+
+    // Number of atoms
+    double count;
+    if (!parse_double(&cursor, &count) || count < 1 || count > INT32_MAX || count != floor(count)) {
+        fprintf(stderr, "%s:%d: expected the number of atoms\n", filename, cursor.line);
+        exit(1);
+    }
+    int n_atoms = (int) count;
+
+    *coords = allocate_vec3_array(n_atoms);
+    *masses = (double*)malloc(n_atoms * sizeof(double));
+    if (*masses == NULL) {
+        fprintf(stderr, "Memory allocation failed for masses!\n");
+        exit(1);
+    }
+
+    // Coordinates and masses
+    for (int i = 0; i < n_atoms; i++) {
+        if (!parse_double(&cursor, &coords->x[i]) || !parse_double(&cursor, &coords->y[i]) ||
+            !parse_double(&cursor, &coords->z[i]) || !parse_double(&cursor, &(*masses)[i])) {
+            fprintf(stderr, "%s:%d: expected the coordinates and the mass of atom %d of %d\n",
+                    filename, cursor.line, i + 1, n_atoms);
+            exit(1);
+        }
+    }
+
+    munmap((void*) data, status.st_size);
+    return n_atoms;
+}
+
+/**
+ * @brief Generates argon atoms on a face-centered cubic lattice filling a cubic box
+ *
+ * The lattice constant follows from the density and is adjusted, so that an
+ * integer number of unit cells fits into the box.
+ * @param box_length Edge length of the box in nm
+ * @param density Number density in atoms per nm^3
+ * @param coords Set to the vectors of the coordinates
+ * @param masses Set to the array of atomic masses
+ * @return Number of atoms
+ * @throws Exits with code 1 if memory allocation fails
+ */
+int generate_fcc_lattice(double box_length, double density, vec3_array* coords, double** masses) {
+    static const double basis[4][3] = {{0.0, 0.0, 0.0}, {0.5, 0.5, 0.0}, {0.5, 0.0, 0.5}, {0.0, 0.5, 0.5}};
+    int n_cells = (int) lround(box_length / cbrt(4.0 / density)); // Unit cells along every edge
+    if (n_cells < 1) {
+        n_cells = 1;
+    }
+    double lattice_constant = box_length / n_cells;
+    int n_atoms = 4 * n_cells * n_cells * n_cells;
+
+    *coords = allocate_vec3_array(n_atoms);
+    *masses = (double*)malloc(n_atoms * sizeof(double));
+    if (*masses == NULL) {
+        fprintf(stderr, "Memory allocation failed for masses!\n");
+        exit(1);
+    }
+
+    int i = 0;
+    for (int cx = 0; cx < n_cells; cx++) {
+        for (int cy = 0; cy < n_cells; cy++) {
+            for (int cz = 0; cz < n_cells; cz++) {
+                for (int b = 0; b < 4; b++) {
+                    coords->x[i] = (cx + basis[b][0]) * lattice_constant;
+                    coords->y[i] = (cy + basis[b][1]) * lattice_constant;
+                    coords->z[i] = (cz + basis[b][2]) * lattice_constant;
+                    (*masses)[i] = ARGON_MASS;
+                    i++;
+                }
+            }
+        }
+    }
+    return n_atoms;
+}
@@ -0,0 +1,362 @@
+/**
+ * @file kernels.c
+ * @brief Contains the Lennard-Jones pair kernels with scalar, AVX2 and AVX-512 variants.
+ *
+ * A kernel evaluates the interactions of one atom i with a row of partners j and
+ * accumulates the forces on all atoms involved. The variant is chosen at runtime
+ * from the features of the CPU. All variants work on r^2 and build the 6th and
+ * 12th powers by multiplication, so no pow or sqrt is needed. The partners of a
+ * row all have the same type, so the coefficients are the same for all pairs. In
+ * a periodic box, the distances follow the minimum-image convention. The virial
+ * r . f of the pairs is summed alongside the energy for the pressure. For the
+ * multiple-time-step integrator, the potential can be weighted with a smooth
+ * switching function, which splits it into a short-range and a long-range part.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define X86_KERNELS // The vectorized variants are available
+#endif
+#include "headers.h"
+
+/**
+ * @brief Interactions of atom i with a row of partners, scalar variant
+ * @param i Index of the atom
+ * @param partners Indices of the partners, NULL for the consecutive atoms first, first + 1, ...
+ * @param first First partner if partners is NULL
+ * @param count Number of partners
+ * @param params Lennard-Jones parameters of the pair of types
+ * @param coords Array of atomic coordinates
+ * @param forces Array accumulating the forces on all atoms
+ * @param virial Accumulates the virial of the row, the sum of r_ij . f_ij
+ * @return Potential energy of the row
+ */
+static double pair_row_scalar(int i, const int* partners, int first, int count, const lj_params* params,
+                              const vec3_array* coords, vec3_array* forces, double* virial) {
+    const double* x = coords->x;
+    const double* y = coords->y;
+    const double* z = coords->z;
+    double fxi = 0.0, fyi = 0.0, fzi = 0.0; // Force on atom i
+    double energy = 0.0;
+    double row_virial = 0.0;
+    for (int n = 0; n < count; n++) {
+        int j = partners != NULL ? partners[n] : first + n;
+        double dx = x[i] - x[j];
+        double dy = y[i] - y[j];
+        double dz = z[i] - z[j];
+        if (params->periodic) {
+            dx -= params->box[0] * nearbyint(dx * params->inv_box[0]);
+            dy -= params->box[1] * nearbyint(dy * params->inv_box[1]);
+            dz -= params->box[2] * nearbyint(dz * params->inv_box[2]);
+        }
+        double r_2 = dx*dx + dy*dy + dz*dz;
+        if (r_2 >= params->cutoff_2) continue;
+
+        double inv_r_2 = 1.0 / r_2;
+        double inv_r_6 = inv_r_2 * inv_r_2 * inv_r_2;
+        double e = inv_r_6 * (params->c12 * inv_r_6 - params->c6);
+        double f = inv_r_6 * (params->force_c12 * inv_r_6 - params->force_c6) * inv_r_2; // Force divided by r
+        if (params->switched) { // Weight w = a + b S(r^2), the force gains the derivative of the weight
+            double t = (r_2 - params->switch_start_2) * params->inv_switch_width_2;
+            t = t < 0.0 ? 0.0 : (t > 1.0 ? 1.0 : t);
+            double w = params->weight_constant + params->weight_switch * (1.0 - t * t * (3.0 - 2.0 * t));
+            f = w * f + params->switch_slope * t * (1.0 - t) * e;
+            e = w * e;
+        }
+        energy += e;
+        row_virial += f * r_2;
+        fxi += f * dx;
+        fyi += f * dy;
+        fzi += f * dz;
+        forces->x[j] -= f * dx;
+        forces->y[j] -= f * dy;
+        forces->z[j] -= f * dz;
+    }
+    forces->x[i] += fxi;
+    forces->y[i] += fyi;
+    forces->z[i] += fzi;
+    *virial += row_virial;
+    return energy;
+}
+
+#ifdef X86_KERNELS
+
+/**
+ * @brief Interactions of atom i with a row of partners, AVX2 variant with 4 pairs at a time
+ * @param i Index of the atom
+ * @param partners Indices of the partners, NULL for the consecutive atoms first, first + 1, ...
+ * @param first First partner if partners is NULL
+ * @param count Number of partners
+ * @param params Lennard-Jones parameters of the pair of types
+ * @param coords Array of atomic coordinates
+ * @param forces Array accumulating the forces on all atoms
+ * @param virial Accumulates the virial of the row, the sum of r_ij . f_ij
+ * @return Potential energy of the row
+ */
+__attribute__((target("avx2")))
+static double pair_row_avx2(int i, const int* partners, int first, int count, const lj_params* params,
+                            const vec3_array* coords, vec3_array* forces, double* virial) {
+    const double* x = coords->x;
+    const double* y = coords->y;
+    const double* z = coords->z;
+    __m256d xi = _mm256_set1_pd(x[i]), yi = _mm256_set1_pd(y[i]), zi = _mm256_set1_pd(z[i]);
+    __m256d cutoff_2 = _mm256_set1_pd(params->cutoff_2);
+    __m256d c6 = _mm256_set1_pd(params->c6), c12 = _mm256_set1_pd(params->c12);
+    __m256d force_c6 = _mm256_set1_pd(params->force_c6), force_c12 = _mm256_set1_pd(params->force_c12);
+    __m256d one = _mm256_set1_pd(1.0);
+    // Switching function of the multiple-time-step integrator
+    __m256d switch_start_2 = _mm256_set1_pd(params->switch_start_2);
+    __m256d inv_switch_width_2 = _mm256_set1_pd(params->inv_switch_width_2);
+    __m256d weight_constant = _mm256_set1_pd(params->weight_constant);
+    __m256d weight_switch = _mm256_set1_pd(params->weight_switch);
+    __m256d switch_slope = _mm256_set1_pd(params->switch_slope);
+    __m256d zero = _mm256_setzero_pd(), three = _mm256_set1_pd(3.0), two = _mm256_set1_pd(2.0);
+    // Zero box lengths of open boundaries leave the distances unchanged
+    __m256d box_x = _mm256_set1_pd(params->box[0]), inv_box_x = _mm256_set1_pd(params->inv_box[0]);
+    __m256d box_y = _mm256_set1_pd(params->box[1]), inv_box_y = _mm256_set1_pd(params->inv_box[1]);
+    __m256d box_z = _mm256_set1_pd(params->box[2]), inv_box_z = _mm256_set1_pd(params->inv_box[2]);
+    __m256d fxi = _mm256_setzero_pd(), fyi = _mm256_setzero_pd(), fzi = _mm256_setzero_pd();
+    __m256d energy = _mm256_setzero_pd(), row_virial = _mm256_setzero_pd();
+
+    int n = 0;
+    for (; n + 4 <= count; n += 4) {
+        __m256d xj, yj, zj;
+        __m128i j; // Partner indices for the gathers
+        if (partners != NULL) {
+            j = _mm_loadu_si128((const __m128i*) (partners + n));
+            xj = _mm256_i32gather_pd(x, j, 8);
+            yj = _mm256_i32gather_pd(y, j, 8);
+            zj = _mm256_i32gather_pd(z, j, 8);
+        }
+        else {
+            xj = _mm256_loadu_pd(x + first + n);
+            yj = _mm256_loadu_pd(y + first + n);
+            zj = _mm256_loadu_pd(z + first + n);
+        }
+        __m256d dx = _mm256_sub_pd(xi, xj);
+        __m256d dy = _mm256_sub_pd(yi, yj);
+        __m256d dz = _mm256_sub_pd(zi, zj);
+        dx = _mm256_sub_pd(dx, _mm256_mul_pd(box_x, _mm256_round_pd(_mm256_mul_pd(dx, inv_box_x), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)));
+        dy = _mm256_sub_pd(dy, _mm256_mul_pd(box_y, _mm256_round_pd(_mm256_mul_pd(dy, inv_box_y), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)));
+        dz = _mm256_sub_pd(dz, _mm256_mul_pd(box_z, _mm256_round_pd(_mm256_mul_pd(dz, inv_box_z), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)));
+        __m256d r_2 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)), _mm256_mul_pd(dz, dz));
+        __m256d inside = _mm256_cmp_pd(r_2, cutoff_2, _CMP_LT_OQ); // Pairs within the cutoff
+
+        __m256d inv_r_2 = _mm256_div_pd(one, r_2);
+        __m256d inv_r_6 = _mm256_mul_pd(_mm256_mul_pd(inv_r_2, inv_r_2), inv_r_2);
+        __m256d e = _mm256_mul_pd(inv_r_6, _mm256_sub_pd(_mm256_mul_pd(c12, inv_r_6), c6));
+        __m256d f = _mm256_mul_pd(_mm256_mul_pd(inv_r_6, _mm256_sub_pd(_mm256_mul_pd(force_c12, inv_r_6), force_c6)), inv_r_2);
+        if (params->switched) { // Weight w = a + b S(r^2), the force gains the derivative of the weight
+            __m256d t = _mm256_mul_pd(_mm256_sub_pd(r_2, switch_start_2), inv_switch_width_2);
+            t = _mm256_min_pd(_mm256_max_pd(t, zero), one);
+            __m256d s = _mm256_sub_pd(one, _mm256_mul_pd(_mm256_mul_pd(t, t), _mm256_sub_pd(three, _mm256_mul_pd(two, t))));
+            __m256d w = _mm256_add_pd(weight_constant, _mm256_mul_pd(weight_switch, s));
+            __m256d slope = _mm256_mul_pd(_mm256_mul_pd(switch_slope, t), _mm256_sub_pd(one, t));
+            f = _mm256_add_pd(_mm256_mul_pd(w, f), _mm256_mul_pd(slope, e));
+            e = _mm256_mul_pd(w, e);
+        }
+        energy = _mm256_add_pd(energy, _mm256_and_pd(e, inside));
+        f = _mm256_and_pd(f, inside);
+        row_virial = _mm256_add_pd(row_virial, _mm256_mul_pd(f, r_2));
+
+        __m256d fx = _mm256_mul_pd(f, dx), fy = _mm256_mul_pd(f, dy), fz = _mm256_mul_pd(f, dz);
+        fxi = _mm256_add_pd(fxi, fx);
+        fyi = _mm256_add_pd(fyi, fy);
+        fzi = _mm256_add_pd(fzi, fz);
+        if (partners != NULL) { // AVX2 has no scatter, the partners of one row are distinct
+            double lanes[3][4];
+            _mm256_storeu_pd(lanes[0], fx);
+            _mm256_storeu_pd(lanes[1], fy);
+            _mm256_storeu_pd(lanes[2], fz);
+            for (int m = 0; m < 4; m++) {
+                int jm = partners[n + m];
+                forces->x[jm] -= lanes[0][m];
+                forces->y[jm] -= lanes[1][m];
+                forces->z[jm] -= lanes[2][m];
+            }
+        }
+        else {
+            double* fxj = forces->x + first + n;
+            double* fyj = forces->y + first + n;
+            double* fzj = forces->z + first + n;
+            _mm256_storeu_pd(fxj, _mm256_sub_pd(_mm256_loadu_pd(fxj), fx));
+            _mm256_storeu_pd(fyj, _mm256_sub_pd(_mm256_loadu_pd(fyj), fy));
+            _mm256_storeu_pd(fzj, _mm256_sub_pd(_mm256_loadu_pd(fzj), fz));
+        }
+    }
+
+    // Horizontal sums of the lanes
+    double lanes[5][4];
+    _mm256_storeu_pd(lanes[0], fxi);
+    _mm256_storeu_pd(lanes[1], fyi);
+    _mm256_storeu_pd(lanes[2], fzi);
+    _mm256_storeu_pd(lanes[3], energy);
+    _mm256_storeu_pd(lanes[4], row_virial);
+    forces->x[i] += (lanes[0][0] + lanes[0][1]) + (lanes[0][2] + lanes[0][3]);
+    forces->y[i] += (lanes[1][0] + lanes[1][1]) + (lanes[1][2] + lanes[1][3]);
+    forces->z[i] += (lanes[2][0] + lanes[2][1]) + (lanes[2][2] + lanes[2][3]);
+    double row_energy = (lanes[3][0] + lanes[3][1]) + (lanes[3][2] + lanes[3][3]);
+    *virial += (lanes[4][0] + lanes[4][1]) + (lanes[4][2] + lanes[4][3]);
+
+    // Remaining pairs
+    return row_energy + pair_row_scalar(i, partners != NULL ? partners + n : NULL, first + n, count - n,
+                                        params, coords, forces, virial);
+}
+
+/**
+ * @brief Interactions of atom i with a row of partners, AVX-512 variant with 8 pairs at a time
+ * @param i Index of the atom
+ * @param partners Indices of the partners, NULL for the consecutive atoms first, first + 1, ...
+ * @param first First partner if partners is NULL
+ * @param count Number of partners
+ * @param params Lennard-Jones parameters of the pair of types
+ * @param coords Array of atomic coordinates
+ * @param forces Array accumulating the forces on all atoms
+ * @param virial Accumulates the virial of the row, the sum of r_ij . f_ij
+ * @return Potential energy of the row
+ */
+__attribute__((target("avx512f")))
+static double pair_row_avx512(int i, const int* partners, int first, int count, const lj_params* params,
+                              const vec3_array* coords, vec3_array* forces, double* virial) {
+    const double* x = coords->x;
+    const double* y = coords->y;
+    const double* z = coords->z;
+    __m512d xi = _mm512_set1_pd(x[i]), yi = _mm512_set1_pd(y[i]), zi = _mm512_set1_pd(z[i]);
+    __m512d cutoff_2 = _mm512_set1_pd(params->cutoff_2);
+    __m512d c6 = _mm512_set1_pd(params->c6), c12 = _mm512_set1_pd(params->c12);
+    __m512d force_c6 = _mm512_set1_pd(params->force_c6), force_c12 = _mm512_set1_pd(params->force_c12);
+    __m512d one = _mm512_set1_pd(1.0);
+    // Switching function of the multiple-time-step integrator
+    __m512d switch_start_2 = _mm512_set1_pd(params->switch_start_2);
+    __m512d inv_switch_width_2 = _mm512_set1_pd(params->inv_switch_width_2);
+    __m512d weight_constant = _mm512_set1_pd(params->weight_constant);
+    __m512d weight_switch = _mm512_set1_pd(params->weight_switch);
+    __m512d switch_slope = _mm512_set1_pd(params->switch_slope);
+    __m512d zero = _mm512_setzero_pd(), three = _mm512_set1_pd(3.0), two = _mm512_set1_pd(2.0);
+    // Zero box lengths of open boundaries leave the distances unchanged
+    __m512d box_x = _mm512_set1_pd(params->box[0]), inv_box_x = _mm512_set1_pd(params->inv_box[0]);
+    __m512d box_y = _mm512_set1_pd(params->box[1]), inv_box_y = _mm512_set1_pd(params->inv_box[1]);
+    __m512d box_z = _mm512_set1_pd(params->box[2]), inv_box_z = _mm512_set1_pd(params->inv_box[2]);
+    __m512d fxi = _mm512_setzero_pd(), fyi = _mm512_setzero_pd(), fzi = _mm512_setzero_pd();
+    __m512d energy = _mm512_setzero_pd(), row_virial = _mm512_setzero_pd();
+
+    int n = 0;
+    for (; n + 8 <= count; n += 8) {
+        __m512d xj, yj, zj;
+        __m256i j = _mm256_setzero_si256(); // Partner indices for the gathers and scatters
+        if (partners != NULL) {
+            j = _mm256_loadu_si256((const __m256i*) (partners + n));
+            xj = _mm512_i32gather_pd(j, x, 8);
+            yj = _mm512_i32gather_pd(j, y, 8);
+            zj = _mm512_i32gather_pd(j, z, 8);
+        }
+        else {
+            xj = _mm512_loadu_pd(x + first + n);
+            yj = _mm512_loadu_pd(y + first + n);
+            zj = _mm512_loadu_pd(z + first + n);
+        }
+        __m512d dx = _mm512_sub_pd(xi, xj);
+        __m512d dy = _mm512_sub_pd(yi, yj);
+        __m512d dz = _mm512_sub_pd(zi, zj);
+        dx = _mm512_sub_pd(dx, _mm512_mul_pd(box_x, _mm512_roundscale_pd(_mm512_mul_pd(dx, inv_box_x), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)));
+        dy = _mm512_sub_pd(dy, _mm512_mul_pd(box_y, _mm512_roundscale_pd(_mm512_mul_pd(dy, inv_box_y), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)));
+        dz = _mm512_sub_pd(dz, _mm512_mul_pd(box_z, _mm512_roundscale_pd(_mm512_mul_pd(dz, inv_box_z), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)));
+        __m512d r_2 = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx, dx), _mm512_mul_pd(dy, dy)), _mm512_mul_pd(dz, dz));
+        __mmask8 inside = _mm512_cmp_pd_mask(r_2, cutoff_2, _CMP_LT_OQ); // Pairs within the cutoff
+
+        __m512d inv_r_2 = _mm512_div_pd(one, r_2);
+        __m512d inv_r_6 = _mm512_mul_pd(_mm512_mul_pd(inv_r_2, inv_r_2), inv_r_2);
+        __m512d e = _mm512_mul_pd(inv_r_6, _mm512_sub_pd(_mm512_mul_pd(c12, inv_r_6), c6));
+        __m512d f = _mm512_mul_pd(_mm512_mul_pd(inv_r_6, _mm512_sub_pd(_mm512_mul_pd(force_c12, inv_r_6), force_c6)), inv_r_2);
+        if (params->switched) { // Weight w = a + b S(r^2), the force gains the derivative of the weight
+            __m512d t = _mm512_mul_pd(_mm512_sub_pd(r_2, switch_start_2), inv_switch_width_2);
+            t = _mm512_min_pd(_mm512_max_pd(t, zero), one);
+            __m512d s = _mm512_sub_pd(one, _mm512_mul_pd(_mm512_mul_pd(t, t), _mm512_sub_pd(three, _mm512_mul_pd(two, t))));
+            __m512d w = _mm512_add_pd(weight_constant, _mm512_mul_pd(weight_switch, s));
+            __m512d slope = _mm512_mul_pd(_mm512_mul_pd(switch_slope, t), _mm512_sub_pd(one, t));
+            f = _mm512_add_pd(_mm512_mul_pd(w, f), _mm512_mul_pd(slope, e));
+            e = _mm512_mul_pd(w, e);
+        }
+        energy = _mm512_mask_add_pd(energy, inside, energy, e);
+        f = _mm512_maskz_mov_pd(inside, f);
+        row_virial = _mm512_add_pd(row_virial, _mm512_mul_pd(f, r_2));
+
+        __m512d fx = _mm512_mul_pd(f, dx), fy = _mm512_mul_pd(f, dy), fz = _mm512_mul_pd(f, dz);
+        fxi = _mm512_add_pd(fxi, fx);
+        fyi = _mm512_add_pd(fyi, fy);
+        fzi = _mm512_add_pd(fzi, fz);
+        if (partners != NULL) { // The partners of one row are distinct, so the scatters do not collide
+            _mm512_i32scatter_pd(forces->x, j, _mm512_sub_pd(_mm512_i32gather_pd(j, forces->x, 8), fx), 8);
+            _mm512_i32scatter_pd(forces->y, j, _mm512_sub_pd(_mm512_i32gather_pd(j, forces->y, 8), fy), 8);
+            _mm512_i32scatter_pd(forces->z, j, _mm512_sub_pd(_mm512_i32gather_pd(j, forces->z, 8), fz), 8);
+        }
+        else {
+            double* fxj = forces->x + first + n;
+            double* fyj = forces->y + first + n;
+            double* fzj = forces->z + first + n;
+            _mm512_storeu_pd(fxj, _mm512_sub_pd(_mm512_loadu_pd(fxj), fx));
+            _mm512_storeu_pd(fyj, _mm512_sub_pd(_mm512_loadu_pd(fyj), fy));
+            _mm512_storeu_pd(fzj, _mm512_sub_pd(_mm512_loadu_pd(fzj), fz));
+        }
+    }
+
+    forces->x[i] += _mm512_reduce_add_pd(fxi);
+    forces->y[i] += _mm512_reduce_add_pd(fyi);
+    forces->z[i] += _mm512_reduce_add_pd(fzi);
+    double row_energy = _mm512_reduce_add_pd(energy);
+    *virial += _mm512_reduce_add_pd(row_virial);
+
+    // Remaining pairs
+    return row_energy + pair_row_scalar(i, partners != NULL ? partners + n : NULL, first + n, count - n,
+                                        params, coords, forces, virial);
+}
+
+#endif
+
+static pair_row_kernel pair_row = pair_row_scalar; //! Kernel used by calculate_accelerations
+static const char* pair_row_name = "scalar"; //! Name of the kernel in use
+
+/**
+ * @brief Selects the variant of the pair kernel
+ *
+ * "auto" picks the widest variant supported by the CPU.
+ * @param requested Name of the variant: "auto", "scalar", "avx2" or "avx512"
+ * @return Name of the selected variant, NULL if the variant is unknown or not supported
+ */
+const char* select_pair_kernel(const char* requested) {
+    int automatic = strcmp(requested, "auto") == 0;
+#ifdef X86_KERNELS
+    __builtin_cpu_init();
+    if ((automatic || strcmp(requested, "avx512") == 0) && __builtin_cpu_supports("avx512f")) {
+        pair_row = pair_row_avx512;
+        pair_row_name = "avx512";
+        return pair_row_name;
+    }
+    if ((automatic || strcmp(requested, "avx2") == 0) && __builtin_cpu_supports("avx2")) {
+        pair_row = pair_row_avx2;
+        pair_row_name = "avx2";
+        return pair_row_name;
+    }
+#endif
+    if (automatic || strcmp(requested, "scalar") == 0) {
+        pair_row = pair_row_scalar;
+        pair_row_name = "scalar";
+        return pair_row_name;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Returns the pair kernel selected by select_pair_kernel
+ * @param name Set to the name of the variant, may be NULL
+ * @return Pair kernel
+ */
+pair_row_kernel get_pair_kernel(const char** name) {
+    if (name != NULL) {
+        *name = pair_row_name;
+    }
+    return pair_row;
+}
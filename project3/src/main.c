@@ -6,7 +6,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
+#include <omp.h>
 #include "headers.h"
 
 /**
@@ -23,6 +23,24 @@ int main(int argc, char *argv[]) {
     double dt = 0.2; //! Time step
     double temperature = 1; //! Temperature 
     int thermo = 0; //! Defines whether thermostat should be used
+    double cutoff = 0.0; //! Cutoff radius of the neighbor-list force engine, 0 uses all pairs
+    double skin = 0.1; //! Skin of the neighbor list in nm
+    const char* kernel = "auto"; //! Variant of the pair kernel
+    int n_threads = 0; //! Number of threads for the forces, 0 keeps the OpenMP default
+    int stride = 1; //! Number of steps between two written frames
+    int format = OUTPUT_XYZ; //! Format of the trajectory
+    int n_slots = 8; //! Number of frames buffered for the writer thread
+    simulation_box box = {0, {0.0, 0.0, 0.0}}; //! Simulation box, open boundaries by default
+    int checkpoint_interval = 0; //! Number of steps between two checkpoints, 0 for none
+    const char* checkpoint_name = "checkpoint"; //! Name of the checkpoint file
+    const char* restart_name = NULL; //! Checkpoint to continue from, NULL for a new run
+    double lattice_box = 0.0; //! Edge length of the generated FCC lattice, 0 to read the input file
+    double lattice_density = 0.0; //! Number density of the generated FCC lattice in atoms per nm^3
+    int respa_steps = 1; //! Inner steps per time step of the multiple-time-step integrator, 1 for velocity Verlet
+    double inner_cutoff = 0.0; //! Cutoff of the short-range forces of the multiple-time-step integrator
+    double reorder_factor = 2.0; //! Growth of the neighbor list spread that triggers a reordering of the atoms, 0 for none
+    int analysis_stride = 0; //! Number of steps between two samples of the observables, 0 for none
+    unsigned long seed = 1; //! Seed of the random initial velocities
 
     // Check which command line options are provided
     if (argc != 2) {
@@ -55,139 +73,527 @@ int main(int argc, char *argv[]) {
                     return 1;
                 }
             }
+            if (strcmp(argv[i], "-c") == 0) {
+                if (i + 1 < argc && atof(argv[i + 1]) > 0) {
+                    cutoff = atof(argv[i + 1]);
+                }
+                else {
+                    fprintf(stderr, "Option -c requires the specification of a positive cutoff radius in nm, e.g. -c 0.85");
+                    return 1;
+                }
+            }
+            if (strcmp(argv[i], "-s") == 0) {
+                if (i + 1 < argc && atof(argv[i + 1]) >= 0) {
+                    skin = atof(argv[i + 1]);
+                }
+                else {
+                    fprintf(stderr, "Option -s requires the specification of the neighbor list skin in nm, e.g. -s 0.1");
+                    return 1;
+                }
+            }
+            if (strcmp(argv[i], "-k") == 0) {
+                if (i + 1 < argc) {
+                    kernel = argv[i + 1];
+                }
+                else {
+                    fprintf(stderr, "Option -k requires the specification of the pair kernel, e.g. -k avx2");
+                    return 1;
+                }
+            }
+            if (strcmp(argv[i], "-j") == 0) {
+                if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+                    n_threads = atoi(argv[i + 1]);
+                }
+                else {
+                    fprintf(stderr, "Option -j requires the specification of a positive number of threads, e.g. -j 4");
+                    return 1;
+                }
+            }
+            if (strcmp(argv[i], "-w") == 0) {
+                if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+                    stride = atoi(argv[i + 1]);
+                }
+                else {
+                    fprintf(stderr, "Option -w requires the specification of a positive write stride, e.g. -w 10");
+                    return 1;
+                }
+            }
+            if (strcmp(argv[i], "-b") == 0) {
+                if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+                    n_slots = atoi(argv[i + 1]);
+                }
+                else {
+                    fprintf(stderr, "Option -b requires the specification of a positive number of buffered frames, e.g. -b 8");
+                    return 1;
+                }
+            }
+            if (strcmp(argv[i], "-p") == 0) {
+                // Either one edge length for a cubic box or three comma-separated ones
+                int n_lengths = i + 1 < argc ? sscanf(argv[i + 1], "%lf,%lf,%lf", &box.length[0], &box.length[1], &box.length[2]) : 0;
+                if (n_lengths == 1) {
+                    box.length[1] = box.length[0];
+                    box.length[2] = box.length[0];
+                }
+                if ((n_lengths == 1 || n_lengths == 3) && box.length[0] > 0 && box.length[1] > 0 && box.length[2] > 0) {
+                    box.periodic = 1;
+                }
+                else {
+                    fprintf(stderr, "Option -p requires the specification of the box edge lengths in nm, e.g. -p 3.4 or -p 3.4,3.4,5.0");
+                    return 1;
+                }
+            }
+            if (strcmp(argv[i], "-C") == 0) {
+                if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+                    checkpoint_interval = atoi(argv[i + 1]);
+                }
+                else {
+                    fprintf(stderr, "Option -C requires the specification of a positive number of steps between checkpoints, e.g. -C 1000");
+                    return 1;
+                }
+            }
+            if (strcmp(argv[i], "-r") == 0) {
+                if (i + 1 < argc) {
+                    restart_name = argv[i + 1];
+                }
+                else {
+                    fprintf(stderr, "Option -r requires the specification of a checkpoint file, e.g. -r checkpoint");
+                    return 1;
+                }
+            }
+            if (strcmp(argv[i], "-g") == 0) {
+                if (i + 1 >= argc || sscanf(argv[i + 1], "%lf,%lf", &lattice_box, &lattice_density) != 2 ||
+                    lattice_box <= 0 || lattice_density <= 0) {
+                    fprintf(stderr, "Option -g requires the specification of the box edge length in nm and the density in atoms per nm^3, e.g. -g 6.3,21");
+                    return 1;
+                }
+            }
+            if (strcmp(argv[i], "-R") == 0) {
+                if (i + 1 >= argc || sscanf(argv[i + 1], "%d,%lf", &respa_steps, &inner_cutoff) != 2 ||
+                    respa_steps < 1 || inner_cutoff <= RESPA_SWITCH_WIDTH) {
+                    fprintf(stderr, "Option -R requires the specification of the inner steps per time step and the inner cutoff in nm, e.g. -R 4,0.5");
+                    return 1;
+                }
+            }
+            if (strcmp(argv[i], "-m") == 0) {
+                if (i + 1 < argc && (atof(argv[i + 1]) > 1 || strcmp(argv[i + 1], "0") == 0)) {
+                    reorder_factor = atof(argv[i + 1]);
+                }
+                else {
+                    fprintf(stderr, "Option -m requires the specification of a growth factor above 1 or 0 to keep the order of the atoms, e.g. -m 2");
+                    return 1;
+                }
+            }
+            if (strcmp(argv[i], "-a") == 0) {
+                if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+                    analysis_stride = atoi(argv[i + 1]);
+                }
+                else {
+                    fprintf(stderr, "Option -a requires the specification of a positive number of steps between samples of the observables, e.g. -a 10");
+                    return 1;
+                }
+            }
+            if (strcmp(argv[i], "-S") == 0) {
+                if (i + 1 < argc) {
+                    seed = strtoul(argv[i + 1], NULL, 10);
+                }
+                else {
+                    fprintf(stderr, "Option -S requires the specification of a seed for the initial velocities, e.g. -S 42");
+                    return 1;
+                }
+            }
+            if (strcmp(argv[i], "-f") == 0) {
+                if (i + 1 < argc && strcmp(argv[i + 1], "xyz") == 0) {
+                    format = OUTPUT_XYZ;
+                }
+                else if (i + 1 < argc && strcmp(argv[i + 1], "binary") == 0) {
+                    format = OUTPUT_BINARY;
+                }
+                else {
+                    fprintf(stderr, "Option -f requires the specification of the trajectory format xyz or binary, e.g. -f binary");
+                    return 1;
+                }
+            }
         }
-        if (argc == 1) {
-            fprintf(stderr, "Usage: %s <filename>\n", argv[0]);
-            return 1;
+    }
+    if (argc == 1 || (argv[1][0] == '-' && lattice_box == 0)) {
+        fprintf(stderr, "Usage: %s <filename> [options] or %s -g <box edge>,<density> [options]\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    // Read the coordinates and masses, or generate a lattice filling a periodic box
+    vec3_array coords; //! Coordinates x, y, z of all atoms
+    double* masses; //! Array of masses of each atom
+    int n_atoms; //! Number of atoms
+    if (lattice_box > 0) {
+        n_atoms = generate_fcc_lattice(lattice_box, lattice_density, &coords, &masses);
+        if (!box.periodic) {
+            box.periodic = 1;
+            box.length[0] = box.length[1] = box.length[2] = lattice_box;
         }
     }
+    else {
+        n_atoms = read_input(argv[1], &coords, &masses);
+    }
 
-    const char* filename = argv[1]; //! Name of the input file
-    
-    // Read number of atoms
-    int n_atoms = read_natoms(filename); //! Number of atoms
-
-    // Allocate arrays
-    double** coords = allocate_2d_array(n_atoms, 3); //! 2D array of coordinates consisting of x, y, z for each atom
-    double** distances = allocate_2d_array(n_atoms, n_atoms); //! 2D array of distances for each pair of atoms 
-    double* masses = (double*)malloc(n_atoms * sizeof(double)); //! Array of masses of each atom
-    if (masses == NULL) {
-        fprintf(stderr, "Memory allocation failed for masses!\n");
-        free_2d_array(coords, n_atoms);
+    // Identify the atom types, the atoms are sorted by type from here on
+    force_field field; //! Lennard-Jones parameters of the atom types
+    int* ids = (int*)malloc(n_atoms * sizeof(int)); //! Index in the input of every atom
+    const char** symbols = (const char**)malloc(n_atoms * sizeof(const char*)); //! Element symbols in the order of the input
+    if (ids == NULL || symbols == NULL) {
+        fprintf(stderr, "Memory allocation failed for the atom ids!\n");
         return 1;
     }
+    if (!assign_types(&coords, masses, n_atoms, &field, ids)) {
+        free_vec3_array(&coords);
+        free(masses);
+        return 1;
+    }
+    for (int t = 0; t < field.n_types; t++) {
+        for (int i = field.type_first[t]; i < field.type_first[t + 1]; i++) {
+            symbols[ids[i]] = field.symbols[t];
+        }
+    }
 
-    // Read coordinates and masses
-    read_coords_and_masses(filename, coords, masses, n_atoms);
+    // Allocate arrays for velocities and accelerations, they are initialized to zero
+    vec3_array velocities = allocate_vec3_array(n_atoms); //! Velocities vx, vy, vz of all atoms
+    vec3_array accelerations = allocate_vec3_array(n_atoms); //! Accelerations ax, ay, az of all atoms, short-range with multiple time steps
+    vec3_array slow_accelerations = allocate_vec3_array(n_atoms); //! Long-range accelerations of the multiple-time-step integrator
 
-    // Validate masses
-    double epsilon; //! Epsilon parameter for the Lennard-Jones potential in j/mol
-    double sigma; //! Sigma parameter for the Lennard-Jones potential in nm
-    if (!validate_atoms(masses, &epsilon, &sigma, n_atoms)) {
-        free_2d_array(coords, n_atoms);
-        free(masses);
+    // Continue from a checkpoint, which restores the settings of the interrupted run
+    int first_step = 0; //! First step to be run
+    double total_energy = 0.0; //! Variable for storing the total energy, set by the first step of a new run
+    checkpoint_state state; //! State of the run stored in the checkpoints
+    vec3_array reference = allocate_vec3_array(n_atoms); //! Coordinates at the last neighbor list build of the checkpoint
+    vec3_array inner_reference = allocate_vec3_array(n_atoms); //! Coordinates at the last short-range neighbor list build of the checkpoint
+    long* rdf_histogram = (long*)calloc(RDF_BINS, sizeof(long)); //! Pair distances binned over all samples
+    if (rdf_histogram == NULL) {
+        fprintf(stderr, "Memory allocation failed for the pair distance histogram!\n");
         return 1;
     }
+    if (restart_name != NULL) {
+        double* input_masses = (double*)malloc(n_atoms * sizeof(double)); //! Masses in the order of the input
+        if (input_masses == NULL) {
+            fprintf(stderr, "Memory allocation failed for masses!\n");
+            return 1;
+        }
+        for (int i = 0; i < n_atoms; i++) {
+            input_masses[ids[i]] = masses[i];
+        }
+        if (!read_checkpoint(restart_name, &state, n_atoms, &coords, &velocities, &accelerations, &reference,
+                             &slow_accelerations, &inner_reference, ids, rdf_histogram)) {
+            return 1;
+        }
+        for (int i = 0; i < n_atoms; i++) { // The atoms are in their order at the checkpoint
+            masses[i] = input_masses[ids[i]];
+        }
+        free(input_masses);
+        first_step = (int) state.step;
+        dt = state.dt;
+        thermo = state.thermo;
+        temperature = state.temperature;
+        total_energy = state.total_energy;
+        box = state.box;
+        cutoff = state.cutoff;
+        skin = state.skin;
+        format = state.format;
+        stride = state.stride;
+        respa_steps = state.respa_steps;
+        inner_cutoff = state.inner_cutoff;
+        reorder_factor = state.reorder_factor;
+        analysis_stride = state.analysis_stride;
+        if (strcmp(kernel, "auto") == 0) {
+            kernel = state.kernel;
+        }
+        if (n_threads == 0) {
+            n_threads = state.n_threads;
+        }
+        if (strcmp(kernel, state.kernel) != 0 || n_threads != state.n_threads) {
+            printf("WARNING: The checkpoint was written with %d threads and the %s kernel, the results will differ in the last digits.\n",
+                   state.n_threads, state.kernel);
+        }
+    }
 
-    // Allocate array for velocities and initialize them to zero
-    double** velocities = allocate_2d_array(n_atoms, 3); //! 2D array of velocities consisting of vx, vy, vz for each atom
-    for (int i = 0; i < n_atoms; i++) {
-        for (int j = 0; j < 3; j++) {
-            velocities[i][j] = 0.0;
+    // The minimum-image convention requires the neighbor list to fit into half the box
+    for (int k = 0; k < 3 && box.periodic && cutoff > 0; k++) {
+        if (cutoff + skin > 0.5 * box.length[k]) {
+            fprintf(stderr, "The cutoff plus the skin must not exceed half of the box edge length %.4f nm\n", box.length[k]);
+            return 1;
         }
     }
-    // Allocate array for accelerations and initialize them to zero
-    double** accelerations = allocate_2d_array(n_atoms, 3); //! 2D array of accelerations consiting of ax, ay, az for each atom
-    for (int i = 0; i < n_atoms; i++) {
-        for (int j = 0; j < 3; j++) {
-            accelerations[i][j] = 0.0;
+
+    // The short-range forces of the multiple-time-step integrator come from a shorter list pruned from the full one
+    if (respa_steps > 1 && (cutoff <= 0 || inner_cutoff + skin > cutoff)) {
+        fprintf(stderr, "Multiple time steps require a cutoff of at least the inner cutoff plus the skin %.4f nm\n", inner_cutoff + skin);
+        return 1;
+    }
+
+    // The pressure and the radial distribution function are only defined in a periodic box
+    double volume = box.periodic ? box.length[0] * box.length[1] * box.length[2] : 0.0; //! Volume of the box, 0 for a cluster
+    int rdf_bins = analysis_stride > 0 && box.periodic ? RDF_BINS : 0; //! Number of bins of the radial distribution function
+    double rdf_range = 0.5 * box.length[0]; //! Largest distance of the radial distribution function, all pairs are known up to it
+    for (int k = 1; k < 3; k++) {
+        if (0.5 * box.length[k] < rdf_range) {
+            rdf_range = 0.5 * box.length[k];
         }
     }
+    if (cutoff > 0) {
+        rdf_range = cutoff;
+    }
 
+    // Choose the variant of the pair kernel
+    const char* kernel_name = select_pair_kernel(kernel); //! Name of the pair kernel in use
+    if (kernel_name == NULL) {
+        fprintf(stderr, "Pair kernel %s is unknown or not supported by this CPU, choose auto, scalar, avx2 or avx512\n", kernel);
+        return 1;
+    }
+    
     // Open files for writing the output
-    const char* trajectory_name = "trajectory.xyz"; //! Name of the file where the trajectory output is written
-    FILE* trajectory_file = open_output(trajectory_name); //! File where the trajectory output is written
-    const char* energy_name = "energies"; //! Name of the file where the energies are written
-    FILE* energy_file = open_output(energy_name); //! File where the energies are written
-    const char* extended_name = "trajectory_velocity.xyz"; //! Name of the file where the extended trajectory with velocities is written
-    FILE* extended_file = open_output(extended_name); //! File where the extended trajectory with velocities is written
-    const char* acceleration_name = "acceleration"; //! Name of the file where the accelerations are written
-    FILE* acceleration_file = open_output(acceleration_name); //! File where the accelerations are written
+    output_writer writer; //! Output files of the energies and the trajectory
+    open_output_writer(&writer, format, stride, n_slots, n_atoms, dt, symbols, restart_name != NULL ? &state.output : NULL);
+    if (analysis_stride > 0) {
+        open_observables(&writer, analysis_stride, volume, restart_name != NULL ? &state.output : NULL);
+    }
 
     // Run 1000 steps of MD simulation
     
     // Initialize energy variables
     double kinetic_energy; //! Variable for storing the kinetic energy
     double potential_energy; //! Variable for storing the potential energy
-    double total_energy; //! Variable for storing the total energy
     double previous_energy; //! Variable for storing the total energy of the previous step
+    double short_energy = 0.0; //! Potential energy of the short-range part of the multiple-time-step integrator
+    double virial; //! Sum of r_ij . f_ij over all pairs, for the pressure
+    double short_virial = 0.0; //! Virial of the short-range part of the multiple-time-step integrator
     
-    // If thermostat option is chosen, initialize random velocities
-    if (thermo == 1) {
-        initialize_velocities(velocities, masses, temperature, n_atoms);
+    // Atoms outside the periodic box are moved to their image inside
+    if (restart_name == NULL) {
+        wrap_positions(&coords, &box, n_atoms);
+    }
+
+    // With a cutoff, the forces are calculated from a Verlet neighbor list
+    neighbor_list list; //! Neighbor list of the cutoff-based force engine
+    double reorder_spread = 0.0; //! Spread of the neighbor list after the last reordering, 0 reorders at the first build
+    int n_reorders = 0; //! Number of reorderings of the atoms
+    if (cutoff > 0) {
+        init_neighbor_list(&list, n_atoms, cutoff, skin, &box, &field);
+        if (restart_name != NULL) {
+            restore_neighbor_list(&list, &reference, state.n_builds, n_atoms);
+            reorder_spread = state.reorder_spread;
+            n_reorders = state.n_reorders;
+        }
+    }
+    neighbor_list inner_list; //! Neighbor list of the short-range forces of the multiple-time-step integrator
+    vec3_array total_accelerations; //! Sum of the short- and long-range accelerations for the output
+    if (respa_steps > 1) {
+        init_neighbor_list(&inner_list, n_atoms, inner_cutoff, skin, &box, &field);
+        inner_list.parent = &list;
+        if (restart_name != NULL) {
+            restore_neighbor_list(&inner_list, &inner_reference, state.n_inner_builds, n_atoms);
+        }
+        total_accelerations = allocate_vec3_array(n_atoms);
+    }
+    vec3_array* output_accelerations = respa_steps > 1 ? &total_accelerations : &accelerations; //! Accelerations written to the output
+    vec3_array* outer_accelerations = respa_steps > 1 ? &slow_accelerations : &accelerations; //! Accelerations of the forces of every time step
+
+    // Every thread accumulates the forces in its own buffer
+    if (n_threads == 0) {
+        n_threads = omp_get_max_threads();
+    }
+    force_buffers buffers; //! Force buffers of the threads
+    init_force_buffers(&buffers, n_atoms, n_threads, rdf_bins, rdf_range / RDF_BINS, rdf_histogram);
+
+    // If thermostat option is chosen, initialize random velocities, which only depend on the seed
+    if (thermo == 1 && restart_name == NULL) {
+        initialize_velocities(&velocities, masses, temperature, n_atoms, ids, seed);
     }
     
-    // Initialize timing variables
-    clock_t start_md, end_md;
+    // Initialize timing variables, wall-clock times as the forces run in parallel
+    double start_md, end_md;
     double total_md_time;
+    double force_time = 0.0; //! Time spent in the force calculation
 
-    start_md = clock(); // Start timing the MD simulation
+    start_md = omp_get_wtime(); // Start timing the MD simulation
 
-    for (int i = 0; i < n_steps; i++){
+    for (int i = first_step; i < n_steps; i++){
 
         // Update positions, velocities and accelerations
-        update_positions(coords, velocities, accelerations, dt, n_atoms);
-        update_velocities(velocities, accelerations, dt, n_atoms); // First velocity update with old accelerations
-        calculate_accelerations(coords, masses, n_atoms, epsilon, sigma, distances, accelerations);
-        update_velocities(velocities, accelerations, dt, n_atoms); // Second velocity update with new accelerations
+        if (respa_steps > 1) {
+            // The long-range forces kick the velocities at both ends of the time step, in between
+            // the short-range forces drive velocity Verlet steps of a fraction of the time step
+            double inner_dt = dt / respa_steps; //! Time step of the short-range forces
+            update_velocities(&velocities, &slow_accelerations, dt, n_atoms);
+            for (int s = 0; s < respa_steps; s++) {
+                update_positions(&coords, &velocities, &accelerations, inner_dt, n_atoms);
+                wrap_positions(&coords, &box, n_atoms);
+                update_velocities(&velocities, &accelerations, inner_dt, n_atoms);
+                double start_force = omp_get_wtime();
+                update_neighbor_list(&list, &coords, n_atoms); // The full list must be valid for pruning
+                update_neighbor_list(&inner_list, &coords, n_atoms);
+                short_energy = calculate_accelerations_neighbor(&coords, masses, n_atoms, &field, &inner_list, &box,
+                                                                FORCE_SHORT, inner_cutoff, &buffers, &accelerations);
+                short_virial = buffers.virial;
+                force_time += omp_get_wtime() - start_force;
+                update_velocities(&velocities, &accelerations, inner_dt, n_atoms);
+            }
+        }
+        else {
+            update_positions(&coords, &velocities, &accelerations, dt, n_atoms);
+            wrap_positions(&coords, &box, n_atoms);
+            update_velocities(&velocities, &accelerations, dt, n_atoms); // First velocity update with old accelerations
+        }
+        double start_force = omp_get_wtime();
+        buffers.sample = analysis_stride > 0 && i % analysis_stride == 0; // The pair distances are binned in the force loop
+        if (cutoff > 0) {
+            // Rebuilt only if an atom moved by more than half the skin, the spread only changes with a build
+            update_neighbor_list(&list, &coords, n_atoms);
+            if (reorder_factor > 0 && list.spread > reorder_factor * reorder_spread) {
+                // The partners drifted apart in memory, sort the atoms along a Morton curve
+                vec3_array* vectors[4] = {&coords, &velocities, &accelerations, &slow_accelerations};
+                reorder_atoms(vectors, respa_steps > 1 ? 4 : 3, masses, ids, n_atoms, &field, &box);
+                restore_neighbor_list(&list, &coords, list.n_builds, n_atoms);
+                if (respa_steps > 1) {
+                    restore_neighbor_list(&inner_list, &coords, inner_list.n_builds, n_atoms);
+                }
+                reorder_spread = list.spread;
+                n_reorders++;
+            }
+            potential_energy = short_energy + calculate_accelerations_neighbor(&coords, masses, n_atoms, &field, &list, &box,
+                                                                               respa_steps > 1 ? FORCE_LONG : FORCE_FULL, inner_cutoff,
+                                                                               &buffers, outer_accelerations);
+        }
+        else {
+            potential_energy = calculate_accelerations(&coords, masses, n_atoms, &field, &box, &buffers, &accelerations);
+        }
+        virial = short_virial + buffers.virial;
+        buffers.sample = 0;
+        force_time += omp_get_wtime() - start_force;
+        update_velocities(&velocities, outer_accelerations, dt, n_atoms); // Second velocity update with new accelerations
+        if (respa_steps > 1) {
+            for (int k = 0; k < n_atoms; k++) {
+                total_accelerations.x[k] = accelerations.x[k] + slow_accelerations.x[k];
+                total_accelerations.y[k] = accelerations.y[k] + slow_accelerations.y[k];
+                total_accelerations.z[k] = accelerations.z[k] + slow_accelerations.z[k];
+            }
+        }
         
-        // Calculate energies
-        kinetic_energy = calculate_kinetic_energy(velocities, masses, n_atoms);
-        potential_energy = calculate_potential_energy(distances, n_atoms, epsilon, sigma);
+        // Calculate the kinetic energy, the potential energy was calculated with the forces
+        kinetic_energy = calculate_kinetic_energy(&velocities, masses, n_atoms);
         previous_energy = total_energy;
         
         // If thermostat is activated, apply velocity-rescale thermostat
         if (thermo == 1) {
-            thermostat(kinetic_energy, temperature, velocities, n_atoms);
-            kinetic_energy = calculate_kinetic_energy(velocities, masses, n_atoms);
+            kinetic_energy = thermostat(kinetic_energy, temperature, &velocities, n_atoms);
         }
         
         // Calculate total energy
         total_energy = calculate_total_energy(kinetic_energy, potential_energy);
         
-        // Check if the total energy is conserved or varies by more than 10 %
-        if (thermo == 0) {
+        // Check if the total energy is conserved or varies by more than 10 %, the first step has no previous energy
+        if (thermo == 0 && i > 0) {
             check_energy(previous_energy, total_energy, i+1);
         } 
 
         // Print output
-        print_output(trajectory_file, energy_file, extended_file, acceleration_file, 
-                     n_atoms, i, kinetic_energy, potential_energy, total_energy,
-                     coords, velocities, accelerations);       
+        write_frame(&writer, i, kinetic_energy, potential_energy, total_energy,
+                    &coords, &velocities, output_accelerations, ids);
+        write_observables(&writer, i, kinetic_energy, potential_energy, total_energy, virial);
+
+        // Write a checkpoint once the output of this step is on disk
+        if (checkpoint_interval > 0 && (i + 1) % checkpoint_interval == 0) {
+            state.step = i + 1;
+            state.dt = dt;
+            state.thermo = thermo;
+            state.temperature = temperature;
+            state.total_energy = total_energy;
+            state.box = box;
+            state.cutoff = cutoff;
+            state.skin = skin;
+            state.n_builds = cutoff > 0 ? list.n_builds : 0;
+            state.respa_steps = respa_steps;
+            state.inner_cutoff = inner_cutoff;
+            state.n_inner_builds = respa_steps > 1 ? inner_list.n_builds : 0;
+            state.reorder_factor = reorder_factor;
+            state.reorder_spread = reorder_spread;
+            state.n_reorders = n_reorders;
+            state.n_threads = n_threads;
+            snprintf(state.kernel, sizeof(state.kernel), "%s", kernel_name);
+            state.format = format;
+            state.stride = stride;
+            state.analysis_stride = analysis_stride;
+            state.rdf_bins = rdf_bins;
+            sync_output_writer(&writer, &state.output);
+            write_checkpoint(checkpoint_name, &state, n_atoms, &coords, &velocities, &accelerations,
+                             cutoff > 0 ? &list.reference : NULL, respa_steps > 1 ? &slow_accelerations : NULL,
+                             respa_steps > 1 ? &inner_list.reference : NULL, ids, rdf_histogram);
+        }
     }
     
-    end_md = clock(); // End timing the MD simulation
+    // Close output files, waiting for the frames still queued for the writer thread
+    close_output_writer(&writer);
+    long n_samples = analysis_stride > 0 ? (n_steps + analysis_stride - 1) / analysis_stride : 0; //! Number of samples of the observables
+    if (rdf_bins > 0) {
+        write_rdf("rdf", rdf_histogram, rdf_bins, rdf_range / RDF_BINS, n_samples, n_atoms, volume);
+    }
+
+    end_md = omp_get_wtime(); // End timing the MD simulation
 
     // Timing statistics
-    total_md_time = ((double) (end_md - start_md)) / CLOCKS_PER_SEC;
-    double average_step_time = total_md_time / n_steps;
+    total_md_time = end_md - start_md;
+    double average_step_time = n_steps > first_step ? total_md_time / (n_steps - first_step) : 0.0;
 
     printf("\n################# Timing Information ################\n");
     printf("Total number of steps:          %d\n", n_steps);
+    if (restart_name != NULL) {
+        printf("Continued from step:            %d\n", first_step);
+    }
     printf("Total MD simulation time:       %.6f seconds\n", total_md_time);
     printf("Average time per step:          %.6f seconds\n", average_step_time);
+    printf("Force calculation time:         %.6f seconds\n", force_time);
+    printf("Number of threads:              %d\n", n_threads);
+    printf("Pair kernel:                    %s\n", kernel_name);
+    printf("Atom types:                     ");
+    for (int t = 0; t < field.n_types; t++) {
+        printf("%s%s %d", t > 0 ? ", " : "", field.symbols[t], field.type_first[t + 1] - field.type_first[t]);
+    }
+    printf("\n");
+    printf("Frames written:                 %ld\n", writer.n_frames);
+    if (analysis_stride > 0) {
+        printf("Observable samples:             %ld\n", n_samples);
+    }
 
-    // Close output files
-    fclose(trajectory_file);  
-    fclose(extended_file);
-    fclose(acceleration_file);
+    // Writes that completed while the integrator was computing were hidden
+    double io_hidden_time = writer.write_time > writer.wait_time ? writer.write_time - writer.wait_time : 0;
+    printf("Output write time:              %.6f seconds\n", writer.write_time);
+    printf("Output wait time:               %.6f seconds\n", writer.wait_time);
+    printf("Output write time hidden:       %.6f seconds (%.1f %%)\n", io_hidden_time,
+           writer.write_time > 0 ? 100 * io_hidden_time / writer.write_time : 0.0);
+    if (cutoff > 0) {
+        printf("Neighbor list builds:           %d\n", list.n_builds);
+        printf("Atom reorderings:               %d\n", n_reorders);
+    }
+    if (respa_steps > 1) {
+        printf("Inner steps per time step:      %d (inner cutoff %.4f nm)\n", respa_steps, inner_cutoff);
+        printf("Short-range list builds:        %d\n", inner_list.n_builds);
+    }
 
     // Free the allocated memory
-    free_2d_array(coords, n_atoms);
-    free_2d_array(distances, n_atoms);
-    free_2d_array(velocities, n_atoms);
-    free_2d_array(accelerations, n_atoms);
+    free_vec3_array(&coords);
+    if (cutoff > 0) {
+        free_neighbor_list(&list);
+    }
+    if (respa_steps > 1) {
+        free_neighbor_list(&inner_list);
+        free_vec3_array(&total_accelerations);
+    }
+    free_force_buffers(&buffers);
+    free_vec3_array(&velocities);
+    free_vec3_array(&accelerations);
+    free_vec3_array(&reference);
+    free_vec3_array(&slow_accelerations);
+    free_vec3_array(&inner_reference);
+    free(rdf_histogram);
     free(masses);
+    free(ids);
+    free(symbols);
 
     return 0;
 }
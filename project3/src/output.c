@@ -0,0 +1,478 @@
+/**
+ * @file output.c
+ * @brief Contains the output subsystem writing the energies and the trajectory.
+ *
+ * Frames are written every stride steps, either as the XYZ text files or as one
+ * binary trajectory of float32 frames. The binary file starts with a header that
+ * holds the number of frames and the size of a frame, so any frame can be read
+ * by seeking to header_size + k * frame_size.
+ *
+ * The integrator only copies a frame into a ring of snapshots. A writer thread
+ * drains the ring to disk, so the simulation waits for the file system only when
+ * all slots of the ring are occupied.
+ *
+ * The observables sampled in situ are one short line per sample, which the
+ * integrator writes itself, and the radial distribution function is written once
+ * at the end of the run from the histogram of all samples.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <omp.h>
+#include "headers.h"
+
+#define OUTPUT_BUFFER_SIZE (1 << 20) // Size of the write buffer of every output file in bytes
+#define TRAJECTORY_MAGIC "MDTRJ001" // First 8 bytes of a binary trajectory
+
+/**
+ * @brief Header of the binary trajectory
+ *
+ * Every frame consists of the step as int32, 4 bytes of padding, the kinetic,
+ * potential and total energy as doubles, followed by the x, y and z arrays of the
+ * coordinates, velocities and accelerations as float32.
+ */
+typedef struct {
+    char magic[8]; //! TRAJECTORY_MAGIC
+    int32_t n_atoms; //! Number of atoms
+    int32_t stride; //! Number of steps between two frames
+    double dt; //! Time step
+    int64_t n_frames; //! Number of frames in the file
+    int64_t frame_size; //! Size of one frame in bytes
+    int64_t header_size; //! Offset of the first frame in bytes
+} trajectory_header;
+
+/**
+ * @brief Opens a file for writing with a large write buffer
+ * @param filename Name of the file
+ * @return File pointer
+ * @throws Exits with code 1 if the file cannot be opened
+ */
+static FILE* open_buffered(const char* filename) {
+    FILE* file = open_output(filename);
+    setvbuf(file, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    return file;
+}
+
+/**
+ * @brief Opens an output file, or reopens it to continue a run
+ *
+ * A resumed file is cut back to its size at the checkpoint, so frames written
+ * after the checkpoint by the interrupted run are dropped. A file shorter than
+ * at the checkpoint has lost data and is rejected rather than padded with zeros.
+ * @param filename Name of the file
+ * @param resume Positions of the output files at the checkpoint, NULL for a new run
+ * @param index Index of the file in the positions
+ * @return File pointer
+ * @throws Exits with code 1 if the file cannot be opened or cut back
+ */
+static FILE* open_output_file(const char* filename, const output_position* resume, int index) {
+    if (resume == NULL) {
+        return open_buffered(filename);
+    }
+    FILE* file = fopen(filename, "r+");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file %s for continuing the run.\n", filename);
+        exit(1);
+    }
+    setvbuf(file, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    struct stat status;
+    if (fstat(fileno(file), &status) != 0 || status.st_size < resume->sizes[index]) {
+        fprintf(stderr, "File %s is shorter than at the checkpoint, the run cannot be continued.\n", filename);
+        exit(1);
+    }
+    if (ftruncate(fileno(file), resume->sizes[index]) != 0 || fseek(file, 0, SEEK_END) != 0) {
+        fprintf(stderr, "Could not restore file %s to its size at the checkpoint.\n", filename);
+        exit(1);
+    }
+    return file;
+}
+
+/**
+ * @brief Writes the header of the binary trajectory
+ * @param writer Output writer
+ */
+static void write_trajectory_header(output_writer* writer) {
+    trajectory_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic));
+    header.n_atoms = writer->n_atoms;
+    header.stride = writer->stride;
+    header.dt = writer->dt;
+    header.n_frames = writer->n_frames;
+    header.frame_size = writer->frame_size;
+    header.header_size = sizeof(trajectory_header);
+    fwrite(&header, sizeof(header), 1, writer->binary_file);
+}
+
+/**
+ * @brief Converts the vectors of all atoms to float32 and appends them to a frame
+ * @param out Position in the frame
+ * @param array Vectors of all atoms
+ * @param n_atoms Number of atoms
+ * @return Position after the vectors
+ */
+static char* append_vectors(char* out, const vec3_array* array, int n_atoms) {
+    const double* components[3] = {array->x, array->y, array->z};
+    for (int k = 0; k < 3; k++) {
+        float* values = (float*) out;
+        for (int i = 0; i < n_atoms; i++) {
+            values[i] = (float) components[k][i];
+        }
+        out += n_atoms * sizeof(float);
+    }
+    return out;
+}
+
+/**
+ * @brief Copies the vectors of all atoms back into the order of the input
+ * @param destination Vectors in the order of the input
+ * @param source Vectors in the current order of the atoms
+ * @param ids Index in the input of every atom
+ * @param n_atoms Number of atoms
+ */
+static void copy_to_input_order(vec3_array* destination, const vec3_array* source, const int* ids, int n_atoms) {
+    for (int i = 0; i < n_atoms; i++) {
+        destination->x[ids[i]] = source->x[i];
+        destination->y[ids[i]] = source->y[i];
+        destination->z[ids[i]] = source->z[i];
+    }
+}
+
+/**
+ * @brief Writes the energies and the trajectory frame of a snapshot
+ * @param writer Output writer
+ * @param snapshot Snapshot to be written
+ */
+static void write_snapshot(output_writer* writer, const frame_snapshot* snapshot) {
+    if (writer->format == OUTPUT_XYZ) {
+        print_output(writer->trajectory_file, writer->energy_file, writer->extended_file, writer->acceleration_file,
+                     writer->symbols, writer->n_atoms, snapshot->step, snapshot->kinetic_energy, snapshot->potential_energy,
+                     snapshot->total_energy, &snapshot->coords, &snapshot->velocities, &snapshot->accelerations);
+    }
+    else {
+        fprintf(writer->energy_file, "%10.8f %10.8f %10.8f\n",
+                snapshot->kinetic_energy, snapshot->potential_energy, snapshot->total_energy);
+
+        // Frame header with the step and the energies
+        char* out = writer->frame;
+        int32_t frame_step[2] = {snapshot->step, 0};
+        double energies[3] = {snapshot->kinetic_energy, snapshot->potential_energy, snapshot->total_energy};
+        memcpy(out, frame_step, sizeof(frame_step));
+        out += sizeof(frame_step);
+        memcpy(out, energies, sizeof(energies));
+        out += sizeof(energies);
+
+        out = append_vectors(out, &snapshot->coords, writer->n_atoms);
+        out = append_vectors(out, &snapshot->velocities, writer->n_atoms);
+        append_vectors(out, &snapshot->accelerations, writer->n_atoms);
+        fwrite(writer->frame, writer->frame_size, 1, writer->binary_file);
+    }
+}
+
+/**
+ * @brief Body of the writer thread
+ *
+ * Writes the snapshots in the order they were queued and releases every slot
+ * once it is on its way to disk. Returns when the ring is empty and the writer
+ * is being closed.
+ * @param arg Pointer to the output_writer
+ * @return NULL
+ */
+static void* writer_thread(void* arg) {
+    output_writer* writer = arg;
+
+    for (;;) {
+        // Wait for the next snapshot
+        pthread_mutex_lock(&writer->lock);
+        while (writer->n_queued == 0 && !writer->closing) {
+            pthread_cond_wait(&writer->cond, &writer->lock);
+        }
+        if (writer->n_queued == 0) {
+            pthread_mutex_unlock(&writer->lock);
+            break; // Closing and everything written
+        }
+        int slot = writer->first_queued;
+        pthread_mutex_unlock(&writer->lock);
+
+        double start = omp_get_wtime();
+        write_snapshot(writer, &writer->ring[slot]);
+        writer->write_time += omp_get_wtime() - start;
+
+        // Hand the slot back to the integrator
+        pthread_mutex_lock(&writer->lock);
+        writer->first_queued = (slot + 1) % writer->n_slots;
+        writer->n_queued--;
+        pthread_cond_broadcast(&writer->cond);
+        pthread_mutex_unlock(&writer->lock);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Opens the output files
+ * @param writer Output writer to be initialized
+ * @param format OUTPUT_XYZ for the text files, OUTPUT_BINARY for the binary trajectory
+ * @param stride Number of steps between two frames
+ * @param n_slots Number of snapshots the ring can hold
+ * @param n_atoms Number of atoms
+ * @param dt Time step
+ * @param symbols Element symbol of every atom in the order of the input
+ * @param resume Positions of the output files at a checkpoint to continue from, NULL for a new run
+ * @throws Exits with code 1 if a file cannot be opened, memory allocation or the start of the writer thread fails
+ */
+void open_output_writer(output_writer* writer, int format, int stride, int n_slots, int n_atoms, double dt,
+                        const char** symbols, const output_position* resume) {
+    writer->format = format;
+    writer->symbols = symbols;
+    writer->stride = stride;
+    writer->n_atoms = n_atoms;
+    writer->dt = dt;
+    writer->n_frames = resume != NULL ? resume->n_frames : 0;
+    writer->frame_size = 0;
+    writer->frame = NULL;
+    writer->trajectory_file = NULL;
+    writer->extended_file = NULL;
+    writer->acceleration_file = NULL;
+    writer->binary_file = NULL;
+    writer->observables_file = NULL;
+    writer->analysis_stride = 0;
+    writer->volume = 0.0;
+
+    writer->energy_file = open_output_file("energies", resume, 0);
+    if (format == OUTPUT_XYZ) {
+        writer->trajectory_file = open_output_file("trajectory.xyz", resume, 1);
+        writer->extended_file = open_output_file("trajectory_velocity.xyz", resume, 2);
+        writer->acceleration_file = open_output_file("acceleration", resume, 3);
+    }
+    else {
+        writer->binary_file = open_output_file("trajectory.trj", resume, 4);
+        writer->frame_size = sizeof(int32_t) * 2 + 3 * sizeof(double) + 9 * (int64_t) n_atoms * sizeof(float);
+        writer->frame = (char*)malloc(writer->frame_size);
+        if (writer->frame == NULL) {
+            fprintf(stderr, "Memory allocation failed for the trajectory frame!\n");
+            exit(1);
+        }
+        if (resume == NULL) {
+            write_trajectory_header(writer); // Rewritten with the number of frames when the file is closed
+        }
+    }
+
+    // Ring of snapshots between the integrator and the writer thread
+    writer->n_slots = n_slots;
+    writer->first_queued = 0;
+    writer->n_queued = 0;
+    writer->closing = 0;
+    writer->write_time = 0.0;
+    writer->wait_time = 0.0;
+    writer->ring = (frame_snapshot*)malloc(n_slots * sizeof(frame_snapshot));
+    if (writer->ring == NULL) {
+        fprintf(stderr, "Memory allocation failed for the output ring!\n");
+        exit(1);
+    }
+    for (int slot = 0; slot < n_slots; slot++) {
+        writer->ring[slot].coords = allocate_vec3_array(n_atoms);
+        writer->ring[slot].velocities = allocate_vec3_array(n_atoms);
+        writer->ring[slot].accelerations = allocate_vec3_array(n_atoms);
+    }
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->cond, NULL);
+    if (pthread_create(&writer->thread, NULL, writer_thread, writer) != 0) {
+        fprintf(stderr, "Could not start the writer thread!\n");
+        exit(1);
+    }
+}
+
+/**
+ * @brief Queues the energies and a trajectory frame if the step is a multiple of the stride
+ *
+ * The vectors are copied into a free slot of the ring, waiting for the writer
+ * thread if the ring is full.
+ * @param writer Output writer
+ * @param step Current simulation step
+ * @param kinetic_energy Current kinetic energy
+ * @param potential_energy Current potential energy
+ * @param total_energy Current total energy
+ * @param coords Array of atomic coordinates
+ * @param velocities Array of atomic velocities
+ * @param accelerations Array of atomic accelerations
+ * @param ids Index in the input of every atom, the frame is written in the order of the input
+ */
+void write_frame(output_writer* writer, int step, double kinetic_energy, double potential_energy, double total_energy,
+                 const vec3_array* coords, const vec3_array* velocities, const vec3_array* accelerations,
+                 const int* ids) {
+    if (step % writer->stride != 0) {
+        return;
+    }
+
+    // Wait for a free slot
+    pthread_mutex_lock(&writer->lock);
+    double start = omp_get_wtime();
+    while (writer->n_queued == writer->n_slots) {
+        pthread_cond_wait(&writer->cond, &writer->lock);
+    }
+    writer->wait_time += omp_get_wtime() - start;
+    int slot = (writer->first_queued + writer->n_queued) % writer->n_slots;
+    pthread_mutex_unlock(&writer->lock);
+
+    frame_snapshot* snapshot = &writer->ring[slot];
+    snapshot->step = step;
+    snapshot->kinetic_energy = kinetic_energy;
+    snapshot->potential_energy = potential_energy;
+    snapshot->total_energy = total_energy;
+    copy_to_input_order(&snapshot->coords, coords, ids, writer->n_atoms);
+    copy_to_input_order(&snapshot->velocities, velocities, ids, writer->n_atoms);
+    copy_to_input_order(&snapshot->accelerations, accelerations, ids, writer->n_atoms);
+
+    // Hand the slot over to the writer thread
+    pthread_mutex_lock(&writer->lock);
+    writer->n_queued++;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+    writer->n_frames++;
+}
+
+/**
+ * @brief Waits until all queued frames are on disk and records the sizes of the output files
+ * @param writer Output writer
+ * @param position Set to the number of frames and the sizes of the output files, -1 for files not in use
+ */
+void sync_output_writer(output_writer* writer, output_position* position) {
+    pthread_mutex_lock(&writer->lock);
+    double start = omp_get_wtime();
+    while (writer->n_queued > 0) {
+        pthread_cond_wait(&writer->cond, &writer->lock);
+    }
+    writer->wait_time += omp_get_wtime() - start;
+    pthread_mutex_unlock(&writer->lock);
+
+    // The writer thread is idle until the next frame is queued
+    FILE* files[OUTPUT_FILES] = {writer->energy_file, writer->trajectory_file, writer->extended_file,
+                                 writer->acceleration_file, writer->binary_file, writer->observables_file};
+    position->n_frames = writer->n_frames;
+    for (int k = 0; k < OUTPUT_FILES; k++) {
+        position->sizes[k] = -1;
+        if (files[k] != NULL) {
+            fflush(files[k]);
+            fsync(fileno(files[k])); // The checkpoint must not record data that a crash can still lose
+            position->sizes[k] = ftell(files[k]);
+        }
+    }
+}
+
+/**
+ * @brief Writes the remaining snapshots, stops the writer thread and closes the output files
+ * @param writer Output writer
+ */
+void close_output_writer(output_writer* writer) {
+    // Let the writer thread drain the ring
+    pthread_mutex_lock(&writer->lock);
+    writer->closing = 1;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+    double start = omp_get_wtime();
+    pthread_join(writer->thread, NULL);
+    writer->wait_time += omp_get_wtime() - start;
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->cond);
+    for (int slot = 0; slot < writer->n_slots; slot++) {
+        free_vec3_array(&writer->ring[slot].coords);
+        free_vec3_array(&writer->ring[slot].velocities);
+        free_vec3_array(&writer->ring[slot].accelerations);
+    }
+    free(writer->ring);
+
+    fclose(writer->energy_file);
+    if (writer->format == OUTPUT_XYZ) {
+        fclose(writer->trajectory_file);
+        fclose(writer->extended_file);
+        fclose(writer->acceleration_file);
+    }
+    else {
+        rewind(writer->binary_file); // Store the final number of frames in the header
+        write_trajectory_header(writer);
+        fclose(writer->binary_file);
+        free(writer->frame);
+    }
+    if (writer->observables_file != NULL) {
+        fclose(writer->observables_file);
+    }
+}
+
+/**
+ * @brief Opens the file of the observables sampled in situ
+ *
+ * Every sample is one line with the step, the temperature, the kinetic, potential
+ * and total energy and, in a periodic box, the pressure from the virial theorem.
+ * @param writer Output writer
+ * @param analysis_stride Number of steps between two samples
+ * @param volume Volume of the periodic box, 0 for a cluster without pressure
+ * @param resume Positions of the output files at a checkpoint to continue from, NULL for a new run
+ * @throws Exits with code 1 if the file cannot be opened
+ */
+void open_observables(output_writer* writer, int analysis_stride, double volume, const output_position* resume) {
+    writer->analysis_stride = analysis_stride;
+    writer->volume = volume;
+    writer->observables_file = open_output_file("observables", resume, 5);
+    if (resume == NULL) {
+        fprintf(writer->observables_file, "# step temperature kinetic potential total%s\n", volume > 0 ? " pressure" : "");
+    }
+}
+
+/**
+ * @brief Writes the observables if the step is a multiple of the analysis stride
+ *
+ * The temperature is in K and the pressure (2 kinetic_energy + virial) / (3 volume)
+ * in kJ/mol/nm^3.
+ * @param writer Output writer
+ * @param step Current simulation step
+ * @param kinetic_energy Current kinetic energy
+ * @param potential_energy Current potential energy
+ * @param total_energy Current total energy
+ * @param virial Sum of r_ij . f_ij over all pairs
+ */
+void write_observables(output_writer* writer, int step, double kinetic_energy, double potential_energy,
+                       double total_energy, double virial) {
+    if (writer->observables_file == NULL || step % writer->analysis_stride != 0) {
+        return;
+    }
+    fprintf(writer->observables_file, "%d %10.8f %10.8f %10.8f %10.8f", step,
+            calculate_temperature(kinetic_energy, writer->n_atoms), kinetic_energy, potential_energy, total_energy);
+    if (writer->volume > 0) {
+        fprintf(writer->observables_file, " %10.8f", (2 * kinetic_energy + virial) / (3 * writer->volume));
+    }
+    fprintf(writer->observables_file, "\n");
+}
+
+/**
+ * @brief Writes the radial distribution function from a histogram of the pair distances
+ *
+ * Every line holds the centre of a bin in nm and g(r), the number of pairs in the bin
+ * relative to an ideal gas of the same density. In a mixture, all pairs are counted.
+ * @param filename Name of the file
+ * @param histogram Number of pairs in every bin, summed over all samples
+ * @param n_bins Number of bins
+ * @param bin_width Width of a bin in nm
+ * @param n_samples Number of samples
+ * @param n_atoms Number of atoms
+ * @param volume Volume of the periodic box
+ * @throws Exits with code 1 if the file cannot be opened
+ */
+void write_rdf(const char* filename, const long* histogram, int n_bins, double bin_width, long n_samples,
+               int n_atoms, double volume) {
+    FILE* file = open_output(filename);
+    double pair_density = 0.5 * n_atoms * (n_atoms - 1) / volume; // Pairs per volume of an ideal gas
+    for (int k = 0; k < n_bins; k++) {
+        double inner = k * bin_width;
+        double outer = inner + bin_width;
+        double shell = 4.0 / 3.0 * PI * (outer * outer * outer - inner * inner * inner);
+        double ideal = n_samples * pair_density * shell;
+        fprintf(file, "%10.6f %10.6f\n", inner + 0.5 * bin_width, ideal > 0 ? histogram[k] / ideal : 0.0);
+    }
+    fclose(file);
+}